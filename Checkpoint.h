@@ -0,0 +1,128 @@
+//
+// Created by Han on 2024/4/13.
+//
+
+#ifndef OPENMP_CHECKPOINT_H
+#define OPENMP_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Compact binary snapshot of the simulation: plain copies of trivially copyable fields, in the
+/// order the engine visits modules and connects. There is no schema, a checkpoint can only be
+/// restored into the same build and the same registration order.
+class CheckpointWriter{
+public:
+    template<typename T>
+    void write(const T& value){
+        static_assert(std::is_trivially_copyable<T>::value, "Checkpoint fields must be trivially copyable");
+        writeBytes(&value, sizeof(T));
+    }
+    template<typename T>
+    void write(const T* data, size_t count){
+        static_assert(std::is_trivially_copyable<T>::value, "Checkpoint fields must be trivially copyable");
+        write<uint64_t>(count);
+        writeBytes(data, count * sizeof(T));
+    }
+    void writeBytes(const void* data, size_t size){
+        auto bytes = static_cast<const char*>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+    }
+    std::vector<char>& buffer(){
+        return m_buffer;
+    }
+    /// Runs on a background thread, the buffer is owned by the caller until it returns
+    static void writeFile(const std::string& path, const std::vector<char>& buffer){
+        FILE* file = std::fopen(path.c_str(), "wb");
+        if(file == nullptr){
+            throw std::runtime_error("Cannot open checkpoint " + path);
+        }
+        size_t written = std::fwrite(buffer.data(), 1, buffer.size(), file);
+        std::fclose(file);
+        if(written != buffer.size()){
+            throw std::runtime_error("Short write to checkpoint " + path);
+        }
+    }
+private:
+    std::vector<char> m_buffer;
+};
+
+/// Reads a checkpoint in place from a memory mapped file
+class CheckpointReader{
+public:
+    explicit CheckpointReader(const std::string& path){
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            throw std::runtime_error("Cannot open checkpoint " + path);
+        }
+        struct stat info{};
+        ::fstat(fd, &info);
+        m_size = static_cast<size_t>(info.st_size);
+        void* data = m_size > 0 ? ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        ::close(fd);
+        if(data == MAP_FAILED){
+            throw std::runtime_error("Cannot map checkpoint " + path);
+        }
+        m_data = static_cast<const char*>(data);
+    }
+    ~CheckpointReader(){
+        if(m_data != nullptr){
+            ::munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+    CheckpointReader(const CheckpointReader&) = delete;
+    CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+    template<typename T>
+    T read(){
+        T value;
+        readBytes(&value, sizeof(T));
+        return value;
+    }
+    template<typename T>
+    void read(T& value){
+        readBytes(&value, sizeof(T));
+    }
+    /// Reads a range written by CheckpointWriter::write(data, count), appending to output
+    template<typename T, typename Container>
+    void readRange(Container& output){
+        auto count = read<uint64_t>();
+        const char* bytes = take(count * sizeof(T));
+        // memcpy element by element, fields in the file are not aligned
+        for(uint64_t i = 0; i < count; i++){
+            T value;
+            std::memcpy(&value, bytes + i * sizeof(T), sizeof(T));
+            output.push_back(value);
+        }
+    }
+    void readBytes(void* output, size_t size){
+        std::memcpy(output, take(size), size);
+    }
+    bool done() const{
+        return m_offset == m_size;
+    }
+private:
+    const char* take(size_t size){
+        if(m_offset + size > m_size){
+            throw std::runtime_error("Checkpoint is truncated");
+        }
+        const char* data = m_data + m_offset;
+        m_offset += size;
+        return data;
+    }
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_offset = 0;
+};
+
+#endif //OPENMP_CHECKPOINT_H
@@ -0,0 +1,314 @@
+//
+// Created by Han on 2024/3/10.
+//
+
+#ifndef OPENMP_CYCLEENGINE_H
+#define OPENMP_CYCLEENGINE_H
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Factory.h"
+#include "ModuleArena.h"
+#include "ParallelLib.h"
+
+/// Runs the registered modules and connects once per cycle on a ThreadPoolOp.
+/// Every cycle is split into two phases by the pool barrier:
+///     evaluate - modules run RunOneCycleTop in parallel, Connect::Write only stages data
+///     commit   - connects publish the staged data and deliver the entries that became ready
+/// A module only observes data committed in earlier cycles, so the result does not depend on
+/// the number of threads or on the order the modules are scheduled in.
+///
+/// Only the active set is visited: a module stays scheduled until it calls SleepUntilInput and
+/// is scheduled again when a connect delivers to it; a connect is scheduled by the first Write of
+/// a cycle and stays scheduled while entries are in flight.
+///
+/// With fast-forward on (the default), a cycle without active modules jumps straight to the
+/// next cycle in which a connect delivers or a module's SleepUntil wakeup is due.
+class CycleEngine{
+public:
+    explicit CycleEngine(int numThreads = 1)
+        : m_num_threads(numThreads > 0 ? numThreads : 1)
+        , m_wakeups_per_thread(m_num_threads){
+        for(int i = 0; i < m_num_threads; i++){
+            m_pool.registerJob([this](int threadIndex){ threadProcess(threadIndex); });
+        }
+    }
+
+    /// Modules start active
+    template<class T>
+    void registerModule(T* module){
+        m_modules.push_back(Entry{[module](uint64_t cycle){
+            module->cycle_count = cycle; // catch up on the cycles skipped while idle
+            module->RunOneCycleTop();
+        }, &module->GetActivity(), nullptr,
+            [module](CheckpointWriter& writer){ module->SaveState(writer); },
+            [module](CheckpointReader& reader){ module->LoadState(reader); }});
+        m_active_modules.resize(m_modules.size());
+        module->GetActivity().Attach(&m_active_modules, static_cast<uint32_t>(m_modules.size() - 1));
+        if(!module->IsIdle()){
+            module->GetActivity().Enqueue();
+        }
+    }
+
+    /// Registers every module of an arena with one scheduling entry per block, so the modules of a
+    /// block are stepped in memory order by one statically dispatched loop. Idle modules in a block
+    /// are skipped with a flag check rather than taken out of the active set, which means a group
+    /// keeps the engine from fast-forwarding. The arena must not grow after this.
+    template<class T, size_t BlockSize, class Alloc>
+    void registerModuleGroup(ModuleArena<T, BlockSize, Alloc>& arena){
+        for(size_t i = 0; i < arena.blockCount(); i++){
+            auto range = arena.block(i);
+            m_group_activities.emplace_back();
+            Activity* activity = &m_group_activities.back();
+            m_modules.push_back(Entry{[range](uint64_t cycle){
+                for(T* module = range.first; module != range.second; module++){
+                    module->PollOneCycle(cycle);
+                }
+            }, activity, nullptr,
+            [range](CheckpointWriter& writer){
+                for(T* module = range.first; module != range.second; module++){
+                    module->SaveState(writer);
+                }
+            },
+            [range](CheckpointReader& reader){
+                for(T* module = range.first; module != range.second; module++){
+                    module->LoadState(reader);
+                }
+            }, true});
+            m_active_modules.resize(m_modules.size());
+            activity->Attach(&m_active_modules, static_cast<uint32_t>(m_modules.size() - 1));
+            activity->Enqueue();
+        }
+    }
+
+    /// Connects start inactive, until the first write
+    template<class T>
+    void registerConnect(T* connect){
+        m_connects.push_back(Entry{[connect](uint64_t cycle){
+            connect->CatchUp(cycle);
+            connect->RunOneCycle();
+            if(connect->HasWork()){
+                connect->GetActivity().Enqueue();
+            }
+        }, &connect->GetActivity(), [connect]{
+            return connect->NeedsCommit() ? 0 : connect->NextDeliveryCycle();
+        },
+            [connect](CheckpointWriter& writer){ connect->SaveState(writer); },
+            [connect](CheckpointReader& reader){ connect->LoadState(reader); }});
+        m_active_connects.resize(m_connects.size());
+        connect->GetActivity().Attach(&m_active_connects, static_cast<uint32_t>(m_connects.size() - 1));
+        if(connect->HasWork()){
+            connect->GetActivity().Enqueue();
+        }
+    }
+
+    /// Registers every module and connect of a ModuleGraph
+    template<class Graph>
+    void registerGraph(Graph& graph){
+        graph.ForEachModule([this](auto& module){ registerModule(&module); });
+        graph.ForEachConnect([this](auto& connect){ registerConnect(&connect); });
+    }
+
+    void run(uint64_t cycles){
+        uint64_t end = m_cycle + cycles;
+        while(m_cycle < end){
+            fireWakeups();
+            m_active_modules.flip();
+            if(m_fast_forward && m_active_modules.size() == 0){
+                uint64_t next = std::min(nextEventCycle(), end);
+                if(next > m_cycle){
+                    m_cycle = next;
+                    continue;
+                }
+            }
+            if(m_active_modules.size() > 0){
+                m_phase = Phase::Evaluate;
+                m_pool.run();
+                collectWakeups();
+            }
+            m_active_connects.flip();
+            if(m_active_connects.size() > 0){
+                m_phase = Phase::Commit;
+                m_pool.run();
+            }
+            m_cycle++;
+        }
+    }
+
+    uint64_t GetCycle() const{
+        return m_cycle;
+    }
+
+    void setFastForward(bool enable){
+        m_fast_forward = enable;
+    }
+
+    /// Snapshots the state of every module and connect between two cycles. Only the copy into
+    /// memory happens here, the file is written on a background thread.
+    void saveCheckpoint(const std::string& path){
+        waitForCheckpoint();
+        CheckpointWriter writer;
+        writer.write(kCheckpointMagic);
+        writer.write(m_cycle);
+        writer.write<uint64_t>(m_modules.size());
+        writer.write<uint64_t>(m_connects.size());
+        for(auto& module: m_modules){
+            module.save(writer);
+        }
+        for(auto& connect: m_connects){
+            connect.save(writer);
+        }
+        auto buffer = std::make_shared<std::vector<char>>(std::move(writer.buffer()));
+        m_checkpoint_write = std::async(std::launch::async, [path, buffer]{
+            CheckpointWriter::writeFile(path, *buffer);
+        });
+    }
+
+    /// Blocks until the last checkpoint is on disk, rethrows its write error if any
+    void waitForCheckpoint(){
+        if(m_checkpoint_write.valid()){
+            m_checkpoint_write.get();
+        }
+    }
+
+    /// Resumes at the cycle of the checkpoint, the same modules and connects have to be registered
+    /// in the same order as when it was taken
+    void loadCheckpoint(const std::string& path){
+        waitForCheckpoint();
+        CheckpointReader reader(path);
+        if(reader.read<uint64_t>() != kCheckpointMagic){
+            throw std::runtime_error("Not a checkpoint: " + path);
+        }
+        auto cycle = reader.read<uint64_t>();
+        if(reader.read<uint64_t>() != m_modules.size() || reader.read<uint64_t>() != m_connects.size()){
+            throw std::runtime_error("Checkpoint does not match the registered modules: " + path);
+        }
+        for(auto& module: m_modules){
+            module.load(reader);
+        }
+        for(auto& connect: m_connects){
+            connect.load(reader);
+        }
+        m_cycle = cycle;
+        reschedule();
+    }
+
+private:
+    enum class Phase{
+        Evaluate,
+        Commit
+    };
+
+    struct Entry{
+        std::function<void(uint64_t)> run;
+        Activity* activity;
+        std::function<uint64_t()> next_delivery; // connects only, 0 when there is something to commit
+        std::function<void(CheckpointWriter&)> save;
+        std::function<void(CheckpointReader&)> load;
+        bool group = false; // arena block, always scheduled
+    };
+
+    static constexpr uint64_t kCheckpointMagic = 0x31545043504d4f; // "OMPCPT1"
+
+    /// Puts every member back into the active sets and the wakeup heap after a restore
+    void reschedule(){
+        m_active_modules.reset();
+        m_active_connects.reset();
+        m_wakeups = decltype(m_wakeups)();
+        for(uint32_t i = 0; i < m_modules.size(); i++){
+            Activity* activity = m_modules[i].activity;
+            activity->Dequeue();
+            if(m_modules[i].group || !activity->IsIdle()){
+                activity->Enqueue();
+            }
+            else if(activity->GetWakeCycle() != Activity::kNoWakeup){
+                m_wakeups.emplace(activity->GetWakeCycle(), i);
+            }
+        }
+        for(auto& connect: m_connects){
+            connect.activity->Dequeue();
+            if(connect.next_delivery() != UINT64_MAX){
+                connect.activity->Enqueue();
+            }
+        }
+    }
+
+    using Wakeup = std::pair<uint64_t, uint32_t>; // cycle, module
+
+    /// The cycle in which something can happen next, nothing changes before it.
+    /// Only valid when no module is active.
+    uint64_t nextEventCycle() const{
+        uint64_t next = m_wakeups.empty() ? UINT64_MAX : m_wakeups.top().first;
+        // Connects with entries in flight are kept in the pending set every cycle
+        for(size_t i = 0; i < m_active_connects.pendingSize(); i++){
+            uint64_t delivery = m_connects[m_active_connects.pending(i)].next_delivery();
+            // An entry delivered in cycle d is moved to the ready fifo by the commit of cycle d - 1
+            next = std::min(next, delivery > 0 ? delivery - 1 : 0);
+        }
+        return next;
+    }
+
+    void fireWakeups(){
+        while(!m_wakeups.empty() && m_wakeups.top().first <= m_cycle){
+            auto wakeup = m_wakeups.top();
+            m_wakeups.pop();
+            Activity* activity = m_modules[wakeup.second].activity;
+            // Stale if the module was woken by input in the meantime
+            if(activity->IsIdle() && activity->GetWakeCycle() == wakeup.first){
+                activity->Wake();
+            }
+        }
+    }
+
+    void collectWakeups(){
+        for(auto& wakeups: m_wakeups_per_thread){
+            for(auto& wakeup: wakeups){
+                m_wakeups.push(wakeup);
+            }
+            wakeups.clear();
+        }
+    }
+
+    void threadProcess(int threadIndex){
+        // Strided split of the active set
+        bool evaluate = m_phase == Phase::Evaluate;
+        auto& entries = evaluate ? m_modules : m_connects;
+        auto& active = evaluate ? m_active_modules : m_active_connects;
+        for(size_t i = threadIndex; i < active.size(); i += m_num_threads){
+            auto& entry = entries[active[i]];
+            entry.activity->Dequeue();
+            entry.run(m_cycle);
+            if(evaluate){
+                if(!entry.activity->IsIdle()){
+                    entry.activity->Enqueue();
+                }
+                else if(entry.activity->GetWakeCycle() != Activity::kNoWakeup){
+                    m_wakeups_per_thread[threadIndex].emplace_back(entry.activity->GetWakeCycle(), active[i]);
+                }
+            }
+        }
+    }
+
+    int m_num_threads = 1;
+    uint64_t m_cycle = 0;
+    Phase m_phase = Phase::Evaluate; // only written between pool runs
+    std::vector<Entry> m_modules;
+    std::vector<Entry> m_connects;
+    ActiveSet m_active_modules;
+    ActiveSet m_active_connects;
+    std::deque<Activity> m_group_activities; // one per arena block, never idle
+    bool m_fast_forward = true;
+    std::vector<std::vector<Wakeup>> m_wakeups_per_thread; // filled during evaluate, merged after it
+    std::priority_queue<Wakeup, std::vector<Wakeup>, std::greater<Wakeup>> m_wakeups;
+    std::future<void> m_checkpoint_write;
+    ThreadPoolOp m_pool; // declared last so the workers are joined before the job lists go away
+};
+
+#endif //OPENMP_CYCLEENGINE_H
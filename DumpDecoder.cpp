@@ -0,0 +1,39 @@
+//
+// Created by Han on 2024/6/1.
+//
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ThreadedDump.h"
+
+/// Renders a binary dump file written by PTD::ThreadedDumpPool (TDPolicy::binary) as text, with
+/// the format strings saved next to it
+/// usage: DumpDecoder file [formats]
+int main(int argc, char* argv[]){
+    if(argc < 2){
+        std::cout << "usage: DumpDecoder file [formats]" << "\n";
+        return 1;
+    }
+    std::string path = argv[1];
+    std::ifstream dump(path, std::ios::binary);
+    char magic[sizeof(TD::kDumpMagic)] = {};
+    if(!dump.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), TD::kDumpMagic)){
+        std::cout << "Not a binary dump " << path << "\n";
+        return 1;
+    }
+    std::vector<std::string> formats = PTD::DumpFormats::load(argc > 2 ? argv[2] : path + ".formats");
+
+    TD::DumpRecord record{};
+    while(dump.read(reinterpret_cast<char*>(&record), sizeof(record))){
+        if(record.format < formats.size()){
+            record.render(std::cout, formats[record.format]);
+        }
+        else{
+            std::cout << "unknown format " << record.format << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+//
+// Created by Han on 2024/6/15.
+//
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#include "ThreadedDump.h"
+
+/// Dump queue policies that no queue can be built from: a depth below two and sampling every 0th
+/// line must be rejected by the pool constructor, setPolicy and the config file, instead of
+/// failing later inside the fifos. Runs in a fresh temporary directory, since the config file is
+/// looked up in the working directory, and exits with 1 on the first failure.
+
+template<class F>
+bool throwsInvalid(const char* what, F f){
+    try{
+        f();
+    }
+    catch(const std::invalid_argument& e){
+        std::cout << what << " rejected: " << e.what() << "\n";
+        return true;
+    }
+    std::cout << what << " accepted\n";
+    return false;
+}
+
+size_t countLines(const std::string& path){
+    std::ifstream in(path);
+    std::string line;
+    size_t lines = 0;
+    while(std::getline(in, line)){
+        lines++;
+    }
+    return lines;
+}
+
+/// Writes lines through a queue of the smallest valid depth, all of them must arrive
+bool smallestDepthWorks(){
+    TD::TDPolicy policy;
+    policy.depth = TD::TDPolicy::kMinDepth;
+    {
+        PTD::ThreadedDumpPool pool(1, policy);
+        for(int i = 0; i < 1000; i++){
+            pool.submit("smallest.txt", std::to_string(i) + "\n");
+        }
+    }
+    bool ok = countLines("smallest.txt") == 1000;
+    std::cout << "depth " << TD::TDPolicy::kMinDepth << (ok ? " ok" : " lost lines") << "\n";
+    return ok;
+}
+
+/// A depth of 1 in the config is reported and the default kept, the file is still dumped
+bool configDepthChecked(){
+    {
+        std::ofstream config(CONFIG_FILE_PATH);
+        config << "config.txt drop_newest 1\n";
+    }
+    for(int i = 0; i < 1000; i++){
+        TD::ThreadedDumpPool::get()->submit("config.txt", std::to_string(i) + "\n");
+    }
+    TD::TDStats stats = TD::ThreadedDumpPool::get()->stats("config.txt");
+    bool ok = stats.lines == 1000;
+    std::cout << "config depth 1" << (ok ? " ok" : " lost lines") << "\n";
+    return ok;
+}
+
+int main(){
+    char dir[] = "/tmp/DumpStressXXXXXX";
+    if(mkdtemp(dir) == nullptr || chdir(dir) != 0){
+        std::cerr << "Cannot create a temporary directory\n";
+        return 1;
+    }
+
+    bool ok = true;
+    for(size_t depth: {0, 1}){
+        TD::TDPolicy policy;
+        policy.depth = depth;
+        std::string name = "depth " + std::to_string(depth);
+        ok = throwsInvalid((name + " as pool default").c_str(), [&]{ PTD::ThreadedDumpPool pool(1, policy); }) && ok;
+        PTD::ThreadedDumpPool pool(1);
+        ok = throwsInvalid((name + " in setPolicy").c_str(), [&]{ pool.setPolicy("bad.txt", policy); }) && ok;
+        policy.overflow = TD::Overflow::DropOldest;
+        ok = throwsInvalid((name + " drop oldest").c_str(), [&]{ pool.setPolicy("bad.txt", policy); }) && ok;
+    }
+    TD::TDPolicy sampling;
+    sampling.overflow = TD::Overflow::Sample;
+    sampling.sampleEvery = 0;
+    PTD::ThreadedDumpPool pool(1);
+    ok = throwsInvalid("sampleEvery 0", [&]{ pool.setPolicy("bad.txt", sampling); }) && ok;
+
+    ok = smallestDepthWorks() && ok;
+    ok = configDepthChecked() && ok;
+    return ok ? 0 : 1;
+}
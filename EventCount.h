@@ -0,0 +1,161 @@
+//
+// Created by Han on 2024/5/11.
+//
+
+#ifndef OPENMP_EVENTCOUNT_H
+#define OPENMP_EVENTCOUNT_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#if defined(__linux__)
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/// CPU hint for spin loops, lets the sibling hyper-thread run and saves power
+inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+/// Lets threads park until notified without a lock on the notify side: a waiter announces
+/// itself with prepareWait, re-checks its condition, then waits on the returned key. The low bit
+/// of the epoch says whether anybody prepared to wait since the last notify, so notifyAll is a
+/// fence and a load unless somebody may be parked, and waiters that were woken but have not run
+/// yet do not cost the notifier another system call. Futex based on Linux, mutex and condition
+/// variable elsewhere.
+class EventCount{
+public:
+    uint32_t prepareWait(){
+        return m_epoch.fetch_or(1, std::memory_order_seq_cst) | 1;
+    }
+    /// Leaves the bit set, the next notify makes one unneeded wake up call at most
+    void cancelWait(){
+    }
+    void wait(uint32_t key){
+#if defined(__linux__)
+        while(m_epoch.load(std::memory_order_acquire) == key){
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+        }
+#else
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_cv.wait(lk, [this, key]{ return m_epoch.load(std::memory_order_acquire) != key; });
+#endif
+    }
+    /// wait with a deadline, false if it passed before a notify
+    bool waitUntil(uint32_t key, std::chrono::steady_clock::time_point deadline){
+#if defined(__linux__)
+        while(m_epoch.load(std::memory_order_acquire) == key){
+            auto left = deadline - std::chrono::steady_clock::now();
+            if(left <= std::chrono::nanoseconds(0)){
+                return false;
+            }
+            auto seconds = std::chrono::duration_cast<std::chrono::seconds>(left);
+            timespec timeout{static_cast<time_t>(seconds.count()),
+                             static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(left - seconds).count())};
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAIT_PRIVATE, key, &timeout, nullptr, 0);
+        }
+        return true;
+#else
+        std::unique_lock<std::mutex> lk(m_mutex);
+        return m_cv.wait_until(lk, deadline, [this, key]{ return m_epoch.load(std::memory_order_acquire) != key; });
+#endif
+    }
+    /// The fence orders the caller's preceding stores against the epoch, like the waiter's
+    /// re-check after prepareWait
+    void notifyAll(){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t epoch = m_epoch.load(std::memory_order_seq_cst);
+        while(epoch & 1){
+            // Odd + 1 clears the bit and changes every outstanding key
+            if(m_epoch.compare_exchange_weak(epoch, epoch + 1, std::memory_order_seq_cst)){
+#if defined(__linux__)
+                syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+                { std::lock_guard<std::mutex> lg(m_mutex); }
+                m_cv.notify_all();
+#endif
+                return;
+            }
+        }
+    }
+private:
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32 bit word");
+    std::atomic<uint32_t> m_epoch{0};
+#if !defined(__linux__)
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+#endif
+};
+
+/// How long a waiting thread spins with cpuRelax before it parks
+struct WaitStrategy{
+    std::chrono::nanoseconds spin = defaultSpin();
+
+    /// Spinning on a single core only delays the thread we are waiting for
+    static std::chrono::nanoseconds defaultSpin(){
+        return std::thread::hardware_concurrency() > 1 ? std::chrono::microseconds(50) : std::chrono::microseconds(0);
+    }
+
+    /// Spins, then parks until pred holds or the deadline passes, returns pred()
+    template<class Pred>
+    bool waitUntil(EventCount& event, Pred pred, std::chrono::steady_clock::time_point deadline) const{
+        auto spinEnd = std::min(deadline, std::chrono::steady_clock::now() +
+                                          std::chrono::duration_cast<std::chrono::steady_clock::duration>(spin));
+        for(uint32_t i = 1; !pred(); i++){
+            cpuRelax();
+            if((i & 63) == 0 && std::chrono::steady_clock::now() > spinEnd){
+                break;
+            }
+        }
+        while(!pred()){
+            uint32_t key = event.prepareWait();
+            if(pred()){
+                event.cancelWait();
+                return true;
+            }
+            if(!event.waitUntil(key, deadline)){
+                return pred();
+            }
+        }
+        return true;
+    }
+
+    template<class Pred>
+    void wait(EventCount& event, Pred pred) const{
+        auto start = std::chrono::steady_clock::now();
+        for(uint32_t i = 1; !pred(); i++){
+            cpuRelax();
+            // Reading the clock costs more than a pause, only check it every so often
+            if((i & 63) == 0 && std::chrono::steady_clock::now() - start > spin){
+                break;
+            }
+        }
+        while(!pred()){
+            uint32_t key = event.prepareWait();
+            if(pred()){
+                event.cancelWait();
+                return;
+            }
+            event.wait(key);
+        }
+    }
+};
+
+
+#endif //OPENMP_EVENTCOUNT_H
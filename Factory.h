@@ -7,8 +7,19 @@
 #include <deque>
 #include <memory>
 #include <future>
+#include <thread>
 #include <iostream>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+
+#include "Checkpoint.h"
+#include "LockFreeFifo.h"
+#include "Trace.h"
 
 #ifndef OPENMP_FACTORY_H
 #define OPENMP_FACTORY_H
@@ -30,56 +41,560 @@ struct ModuleBModuleAConnect{
     uint64_t m_data = 0;
 };
 
-/// All modules stored inside
-struct ModuleContainer{
+using AtoBConnectType = Connect<ModuleAModuleBConnect, ModuleA, ModuleB>;
+using BtoAConnectType = Connect<ModuleBModuleAConnect, ModuleB, ModuleA>;
+
+//// Activity Tracking
+/// Ids of the modules (or connects) that run in the next cycle, double buffered so pushes for the
+/// next cycle can happen while the current one is iterated. Members are pushed at most once per
+/// cycle (see Activity), so both buffers are sized once and a push is a single fetch_add.
+class ActiveSet{
 public:
-    static ModuleContainer& GetModuleContainer(){
-        static ModuleContainer container;
-        return container;
+    void resize(size_t size){
+        m_ids[0].resize(size);
+        m_ids[1].resize(size);
+    }
+    void push(uint32_t id){
+        m_ids[m_next][m_size[m_next].fetch_add(1, std::memory_order_relaxed)] = id;
+    }
+    /// Makes everything pushed so far the current set and starts an empty next set.
+    /// Must not run concurrently with push.
+    void flip(){
+        m_next ^= 1;
+        m_size[m_next].store(0, std::memory_order_relaxed);
+    }
+    size_t size() const{
+        return m_size[m_next ^ 1].load(std::memory_order_relaxed);
+    }
+    uint32_t operator[](size_t index) const{
+        return m_ids[m_next ^ 1][index];
+    }
+    /// Empties both buffers, members have to be dequeued separately
+    void reset(){
+        m_size[0].store(0, std::memory_order_relaxed);
+        m_size[1].store(0, std::memory_order_relaxed);
+    }
+    /// Members pushed for the next cycle so far
+    size_t pendingSize() const{
+        return m_size[m_next].load(std::memory_order_relaxed);
+    }
+    uint32_t pending(size_t index) const{
+        return m_ids[m_next][index];
     }
-    /// Put all modules here, and initialise
-    std::shared_ptr<ModuleA> moduleA = std::make_shared<ModuleA>();
-    std::shared_ptr<ModuleB> moduleB = std::make_shared<ModuleB>();
+private:
+    std::vector<uint32_t> m_ids[2];
+    std::atomic<size_t> m_size[2] = {{0}, {0}};
+    int m_next = 0;
 };
 
-struct ConnectContainer{
-    std::shared_ptr<Connect<ModuleAModuleBConnect, ModuleA, ModuleB>> m_AtoBConnect = nullptr;
-    std::shared_ptr<Connect<ModuleBModuleAConnect, ModuleB, ModuleA>> m_BtoAConnect = nullptr;
+/// Scheduling state of one module or connect. Without an attached ActiveSet only the idle flag
+/// is tracked, which is what ModuleGraph uses.
+class Activity{
+public:
+    Activity() = default;
+    // A copy is a new, unscheduled member
+    Activity(const Activity& other) : m_idle(other.IsIdle()), m_wake_cycle(other.GetWakeCycle()){}
+    Activity& operator=(const Activity& other){
+        m_idle.store(other.IsIdle(), std::memory_order_relaxed);
+        m_wake_cycle.store(other.GetWakeCycle(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void Attach(ActiveSet* set, uint32_t id){
+        m_set = set;
+        m_id = id;
+        m_queued.store(false, std::memory_order_relaxed);
+    }
+    /// Clears the idle flag and schedules the member for the next cycle. Several connects that
+    /// share a module may call this at the same time in the commit phase, they all store the same
+    /// value.
+    void Wake(){
+        m_wake_cycle.store(kNoWakeup, std::memory_order_relaxed);
+        m_idle.store(false, std::memory_order_relaxed);
+        Enqueue();
+    }
+    void Sleep(){
+        m_idle.store(true, std::memory_order_relaxed);
+    }
+    /// Sleep with a scheduled wakeup, an earlier Wake cancels it
+    void SleepUntil(uint64_t cycle){
+        m_wake_cycle.store(cycle, std::memory_order_relaxed);
+        Sleep();
+    }
+    uint64_t GetWakeCycle() const{
+        return m_wake_cycle.load(std::memory_order_relaxed);
+    }
+    bool IsDue(uint64_t cycle) const{
+        return GetWakeCycle() <= cycle;
+    }
+    /// Sets the state read from a checkpoint, the scheduler re-enqueues the member itself
+    void Restore(bool idle, uint64_t wakeCycle){
+        m_idle.store(idle, std::memory_order_relaxed);
+        m_wake_cycle.store(wakeCycle, std::memory_order_relaxed);
+    }
+    bool IsIdle() const{
+        return m_idle.load(std::memory_order_relaxed);
+    }
+    void Enqueue(){
+        if(m_set != nullptr && !m_queued.exchange(true, std::memory_order_acq_rel)){
+            m_set->push(m_id);
+        }
+    }
+    /// Called by the scheduler when it takes the member out of the current set
+    void Dequeue(){
+        m_queued.store(false, std::memory_order_relaxed);
+    }
+    static constexpr uint64_t kNoWakeup = UINT64_MAX;
+private:
+    std::atomic<bool> m_idle{false};
+    std::atomic<bool> m_queued{false};
+    // Set by the member itself in evaluate and by Wake in commit, the pool's barrier orders the two
+    std::atomic<uint64_t> m_wake_cycle{kNoWakeup};
+    ActiveSet* m_set = nullptr;
+    uint32_t m_id = 0;
+};
+
+//// Module Graph
+template<typename... Modules>
+struct ModuleList{};
+
+template<typename... Connects>
+struct ConnectList{};
+
+/// The whole topology declared once at compile time, e.g.
+///     ModuleGraph<ModuleList<ModuleA, ModuleB>, ConnectList<AtoBConnectType, BtoAConnectType>>
+/// Modules and connects are held by value, every connect is wired to its upper and down module
+/// through their Bind() overloads, and RunOneCycle expands into a flat list of direct calls.
+/// Idle modules and connects without anything in flight are skipped.
+template<class ModuleListType, class ConnectListType>
+class ModuleGraph;
+
+template<class... Modules, class... Connects>
+class ModuleGraph<ModuleList<Modules...>, ConnectList<Connects...>>{
+public:
+    ModuleGraph()
+        : m_connects(Connects(&std::get<typename Connects::upper_type>(m_modules),
+                              &std::get<typename Connects::down_type>(m_modules))...){
+        (bind(std::get<Connects>(m_connects)), ...);
+    }
+    // Connects and modules keep raw pointers into this object
+    ModuleGraph(const ModuleGraph&) = delete;
+    ModuleGraph& operator=(const ModuleGraph&) = delete;
+
+    template<class T>
+    T& Get(){
+        if constexpr ((std::is_same<T, Modules>::value || ...)){
+            return std::get<T>(m_modules);
+        }
+        else{
+            return std::get<T>(m_connects);
+        }
+    }
+
+    void RunOneCycle(){
+        std::apply([this](Modules&... module){ (runModule(module), ...); }, m_modules);
+        std::apply([this](Connects&... connect){ (runConnect(connect), ...); }, m_connects);
+        m_cycle++;
+    }
+
+    uint64_t GetCycle() const{
+        return m_cycle;
+    }
+
+    void Run(uint64_t cycles){
+        for(uint64_t i = 0; i < cycles; i++){
+            RunOneCycle();
+        }
+    }
+
+    template<class F>
+    void ForEachModule(F&& func){
+        std::apply([&func](Modules&... module){ (func(module), ...); }, m_modules);
+    }
+
+    template<class F>
+    void ForEachConnect(F&& func){
+        std::apply([&func](Connects&... connect){ (func(connect), ...); }, m_connects);
+    }
+
+private:
+    template<class M>
+    void runModule(M& module){
+        module.PollOneCycle(m_cycle);
+    }
+    template<class C>
+    void runConnect(C& connect){
+        if(connect.HasWork()){
+            connect.CatchUp(m_cycle);
+            connect.RunOneCycle();
+        }
+    }
+    template<class C>
+    void bind(C& connect){
+        std::get<typename C::upper_type>(m_modules).Bind(&connect);
+        std::get<typename C::down_type>(m_modules).Bind(&connect);
+    }
+
+    std::tuple<Modules...> m_modules;
+    std::tuple<Connects...> m_connects;
+    uint64_t m_cycle = 0;
+};
+
+//// Ready Queue
+/// Growable ring holding the delivered entries of a Connect. Batches go in and out as at most two
+/// contiguous copies instead of one node per element.
+template<typename T>
+class RingQueue{
+public:
+    size_t size() const{
+        return m_size;
+    }
+    bool empty() const{
+        return m_size == 0;
+    }
+    void push_back(const T* data, size_t count){
+        reserve(m_size + count);
+        size_t tail = (m_head + m_size) & (m_buffer.size() - 1);
+        size_t first = std::min(count, m_buffer.size() - tail);
+        std::copy(data, data + first, m_buffer.begin() + tail);
+        std::copy(data + first, data + count, m_buffer.begin());
+        m_size += count;
+    }
+    /// Copies all entries into out, front first, without popping them
+    void copy(T* out) const{
+        size_t first = std::min(m_size, m_buffer.size() - m_head);
+        std::copy(m_buffer.begin() + m_head, m_buffer.begin() + m_head + first, out);
+        std::copy(m_buffer.begin(), m_buffer.begin() + (m_size - first), out + first);
+    }
+    void clear(){
+        m_head = 0;
+        m_size = 0;
+    }
+    /// Pops up to count entries into out, returns how many were popped
+    size_t pop_front(T* out, size_t count){
+        count = std::min(count, m_size);
+        size_t first = std::min(count, m_buffer.size() - m_head);
+        std::copy(m_buffer.begin() + m_head, m_buffer.begin() + m_head + first, out);
+        std::copy(m_buffer.begin(), m_buffer.begin() + (count - first), out + first);
+        m_head = count == 0 ? m_head : (m_head + count) & (m_buffer.size() - 1);
+        m_size -= count;
+        return count;
+    }
+private:
+    void reserve(size_t size){
+        if(size <= m_buffer.size()){
+            return;
+        }
+        size_t capacity = m_buffer.empty() ? 16 : m_buffer.size();
+        while(capacity < size){
+            capacity <<= 1;
+        }
+        std::vector<T> buffer(capacity);
+        size_t count = m_size;
+        pop_front(buffer.data(), count);
+        m_buffer.swap(buffer);
+        m_head = 0;
+        m_size = count;
+    }
+    std::vector<T> m_buffer;
+    size_t m_head = 0;
+    size_t m_size = 0;
 };
 
 //// Connect Template Base
+/// Entries are kept in a timing wheel keyed by the connect's cycle: a write lands in the slot of
+/// the cycle it becomes ready, and RunOneCycle only drains the slot of the current cycle, so the
+/// per-cycle cost does not depend on the number of entries in flight.
+/// Write only stages the entry; it is published by RunOneCycle (the commit phase), so the upper
+/// module writing and the down module reading never touch the same container within a cycle.
+/// A connect only needs to run while it has staged or in-flight entries; delivering an entry
+/// wakes the down module.
+///
+/// Optional link limits: bandwidth caps how many entries can be written per cycle, capacity caps
+/// the entries held by the connect (staged, in flight and delivered but not read). Capacity is
+/// enforced with credits: a write takes one, a read returns one, and returned credits become
+/// visible to the upper module at the next commit, which also wakes it up. 0 means unlimited.
+///
+/// A split connect links two partitions (see Partition.h): the upper side pushes committed
+/// entries, stamped with their delivery cycle, into a Fifo4 and the down side delivers them in
+/// its own cycle. The wheel is not used then.
 template<typename connectType, class upperModule, class downModule>
 class Connect : FactoryBase<Connect<connectType, upperModule, downModule>>{
 public:
+    using data_type = connectType;
+    using upper_type = upperModule;
+    using down_type = downModule;
+    using FactoryBase<Connect<connectType, upperModule, downModule>>::GetActivity;
+
     Connect() = delete;
-    Connect(std::shared_ptr<upperModule> up, std::shared_ptr<downModule> down){
+    Connect(upperModule* up, downModule* down, uint32_t latency = 1, uint32_t bandwidth = 0, size_t capacity = 0)
+        : m_latency(latency > 0 ? latency : 1) // writes are published at commit, one cycle is the minimum
+        , m_bandwidth(bandwidth)
+        , m_capacity(capacity)
+        , m_credits(capacity)
+        , m_wheel(wheelSize(m_latency))
+        , m_wheel_mask(wheelSize(m_latency) - 1){
         m_upper_module = up;
         m_down_module = down;
     }
     void RunOneCycle(){
         latencyUpdate();
     }
-    void Write(connectType& input){
-        m_data_fifo.template emplace_back(input, 1);
+    /// Stages one entry, false when out of credits or bandwidth for this cycle
+    bool Write(const connectType& input){
+        return WriteBatch(&input, 1) == 1;
+    }
+    /// Stages up to count entries, returns how many were accepted
+    size_t WriteBatch(const connectType* data, size_t count){
+        count = std::min(count, WriteAvailable());
+        if(count == 0){
+            return 0;
+        }
+        // Each side only looks at its own state, Enqueue is idempotent if both schedule the commit
+        if(m_staged.empty()){
+            this->activity.Enqueue();
+        }
+        m_staged.insert(m_staged.end(), data, data + count);
+        if(m_capacity > 0){
+            m_credits -= count;
+        }
+        return count;
+    }
+    /// How many entries the upper module can still write in this cycle
+    size_t WriteAvailable() const{
+        size_t available = m_bandwidth == 0 ? SIZE_MAX : m_bandwidth - m_staged.size();
+        return m_capacity == 0 ? available : std::min(available, m_credits);
     }
     bool Read(connectType& output){
-        if(!m_data_fifo.empty() && m_data_fifo.front().second == 0){
-            output = m_data_fifo.front().first;
-            m_data_fifo.pop_front();
-            return true;
+        return ReadBatch(&output, 1) == 1;
+    }
+    /// Pops up to count delivered entries into output, returns how many were read
+    size_t ReadBatch(connectType* output, size_t count){
+        count = m_ready_fifo.pop_front(output, count);
+        if(m_capacity > 0 && count > 0){
+            if(m_returned_credits == 0){
+                this->activity.Enqueue();
+            }
+            m_returned_credits += count;
+        }
+        return count;
+    }
+    /// Number of delivered entries waiting to be read
+    size_t ReadAvailable() const{
+        return m_ready_fifo.size();
+    }
+    upperModule* GetUpperModule() const{
+        return m_upper_module;
+    }
+    downModule* GetDownModule() const{
+        return m_down_module;
+    }
+
+    /// Everything needed to resume the connect at the same cycle: limits, credits, staged,
+    /// in-flight and delivered entries. Split connects are not supported.
+    void SaveState(CheckpointWriter& writer) const{
+        assert(!IsSplit());
+        writer.write(m_latency);
+        writer.write(m_bandwidth);
+        writer.write<uint64_t>(m_capacity);
+        writer.write<uint64_t>(m_credits);
+        writer.write<uint64_t>(m_returned_credits);
+        writer.write(m_cycle);
+        writer.write(m_staged.data(), m_staged.size());
+        writer.write<uint64_t>(m_delivery_cycles.size());
+        for(uint64_t cycle: m_delivery_cycles){
+            auto& slot = m_wheel[cycle & m_wheel_mask];
+            writer.write(cycle);
+            writer.write(slot.data(), slot.size());
+        }
+        std::vector<connectType> ready(m_ready_fifo.size());
+        m_ready_fifo.copy(ready.data());
+        writer.write(ready.data(), ready.size());
+    }
+    void LoadState(CheckpointReader& reader){
+        assert(!IsSplit());
+        m_staged.clear();
+        m_delivery_cycles.clear();
+        m_in_flight = 0;
+        SetLatency(reader.read<uint32_t>()); // also empties the wheel
+        reader.read(m_bandwidth);
+        m_capacity = reader.read<uint64_t>();
+        m_credits = reader.read<uint64_t>();
+        m_returned_credits = reader.read<uint64_t>();
+        reader.read(m_cycle);
+        reader.readRange<connectType>(m_staged);
+        auto batches = reader.read<uint64_t>();
+        for(uint64_t i = 0; i < batches; i++){
+            auto cycle = reader.read<uint64_t>();
+            auto& slot = m_wheel[cycle & m_wheel_mask];
+            reader.readRange<connectType>(slot);
+            m_in_flight += slot.size();
+            m_delivery_cycles.push_back(cycle);
+        }
+        std::vector<connectType> ready;
+        reader.readRange<connectType>(ready);
+        m_ready_fifo.clear();
+        m_ready_fifo.push_back(ready.data(), ready.size());
+    }
+
+    /// Carries the connect over a ring of the given size, only valid while the connect is empty.
+    /// Credits are local to one thread, so capacity limits are not supported on a split connect.
+    void Split(size_t ringCapacity){
+        assert(m_capacity == 0 && !HasWork() && m_ready_fifo.empty());
+        m_link.reset(new Fifo4<RemoteEntry>(ringCapacity));
+    }
+    bool IsSplit() const{
+        return m_link != nullptr;
+    }
+    /// Upper partition side of the commit of the given cycle. Entries are built in place and
+    /// published once per batch. While the ring is full whileFull is called, the partition drains
+    /// its own incoming links there so the down partition is never waiting on it in turn.
+    template<class WhileFull>
+    void CommitRemote(uint64_t cycle, WhileFull whileFull){
+        size_t next = 0;
+        while(next < m_staged.size()){
+            auto slots = m_link->reserve(m_staged.size() - next);
+            if(slots.empty()){
+                whileFull();
+                continue;
+            }
+            for(size_t i = 0; i < slots.size(); i++){
+                slots.construct(i, cycle + m_latency, std::move(m_staged[next + i]));
+            }
+            m_link->commit(slots.size());
+            next += slots.size();
         }
-        return false;
+        m_staged.clear();
+    }
+    /// Down partition side, moves everything the upper side pushed so far to the inbox
+    void DrainRemote(){
+        while(true){
+            auto entries = m_link->peek(m_link->capacity());
+            if(entries.empty()){
+                return;
+            }
+            for(size_t i = 0; i < entries.size(); i++){
+                m_inbox.push_back(std::move(entries[i]));
+            }
+            m_link->release(entries.size());
+        }
+    }
+    /// Down partition side of the commit of the given cycle, every entry pushed with a delivery
+    /// cycle up to cycle + 1 must have been drained before
+    void DeliverRemote(uint64_t cycle){
+        bool delivered = false;
+        while(!m_inbox.empty() && m_inbox.front().first <= cycle + 1){
+            m_ready_fifo.push_back(&m_inbox.front().second, 1);
+            m_inbox.pop_front();
+            delivered = true;
+        }
+        if(delivered){
+            m_down_module->WakeUp();
+        }
+    }
+    uint32_t GetLatency() const{
+        return m_latency;
+    }
+    uint32_t GetBandwidth() const{
+        return m_bandwidth;
+    }
+    size_t GetCapacity() const{
+        return m_capacity;
+    }
+    /// Credits the upper module holds, SIZE_MAX without a capacity limit
+    size_t GetCredits() const{
+        return m_capacity == 0 ? SIZE_MAX : m_credits;
+    }
+    bool HasWork() const{
+        return NeedsCommit() || m_in_flight > 0;
+    }
+    /// Staged entries or returned credits to publish
+    bool NeedsCommit() const{
+        return !m_staged.empty() || m_returned_credits > 0;
+    }
+    /// First cycle in which the down module can read an entry that is in flight now
+    uint64_t NextDeliveryCycle() const{
+        return m_delivery_cycles.empty() ? UINT64_MAX : m_delivery_cycles.front();
+    }
+    /// Moves the wheel to the given cycle, skipping cycles in which nothing is delivered
+    void CatchUp(uint64_t cycle){
+        assert(NextDeliveryCycle() > cycle);
+        m_cycle = cycle;
+    }
+    /// Only valid while nothing is in flight, the wheel is resized to fit the new latency
+    void SetLatency(uint32_t latency){
+        assert(m_staged.empty() && m_in_flight == 0);
+        m_latency = latency > 0 ? latency : 1;
+        m_wheel.assign(wheelSize(m_latency), {});
+        m_wheel_mask = m_wheel.size() - 1;
+    }
+    void SetBandwidth(uint32_t bandwidth){
+        m_bandwidth = bandwidth;
+    }
+    /// Only valid while the connect is empty, all credits go back to the upper module
+    void SetCapacity(size_t capacity){
+        assert(m_staged.empty() && m_in_flight == 0 && m_ready_fifo.empty());
+        m_capacity = capacity;
+        m_credits = capacity;
+        m_returned_credits = 0;
     }
 private:
     void latencyUpdate(){
-        std::cout << "Connect update latency" << "\n";
-        for(auto& entry: m_data_fifo){
-            std::get<1>(entry) -= (std::get<1>(entry) > 0 ? 1 : 0);
+        FACTORY_TRACE(Trace::Verbose, m_cycle, GetTraceID(), Trace::ConnectUpdate, m_staged.size());
+        if(m_returned_credits > 0){
+            m_credits += m_returned_credits;
+            m_returned_credits = 0;
+            m_upper_module->WakeUp();
         }
+        if(!m_staged.empty()){
+            auto& target = m_wheel[(m_cycle + m_latency) & m_wheel_mask];
+            target.insert(target.end(), m_staged.begin(), m_staged.end());
+            m_in_flight += m_staged.size();
+            m_staged.clear();
+            m_delivery_cycles.push_back(m_cycle + m_latency); // latency is fixed, so this stays sorted
+        }
+        m_cycle++;
+        auto& slot = m_wheel[m_cycle & m_wheel_mask];
+        if(!slot.empty()){
+            m_ready_fifo.push_back(slot.data(), slot.size());
+            m_in_flight -= slot.size();
+            slot.clear(); // keeps the capacity, the slot is reused every m_wheel.size() cycles
+            m_delivery_cycles.pop_front();
+            m_down_module->WakeUp();
+        }
+    }
+    uint32_t GetTraceID(){
+        if(m_trace_id == Trace::kUnregistered){
+            m_trace_id = Trace::Sink::get().registerModule(m_upper_module->GetModuleID() + "->" + m_down_module->GetModuleID());
+        }
+        return m_trace_id;
     }
-    std::shared_ptr<upperModule> m_upper_module = nullptr;
-    std::shared_ptr<downModule> m_down_module = nullptr;
-    std::deque<std::pair<connectType, int>> m_data_fifo{};
+    static size_t wheelSize(uint32_t latency){
+        // Power of two, strictly larger than the latency so a write never lands in the slot being drained
+        size_t size = 1;
+        while(size <= latency){
+            size <<= 1;
+        }
+        return size;
+    }
+    upperModule* m_upper_module = nullptr;
+    downModule* m_down_module = nullptr;
+    uint32_t m_latency = 1;
+    uint32_t m_bandwidth = 0;
+    size_t m_capacity = 0;
+    size_t m_credits = 0;          // upper module side
+    size_t m_returned_credits = 0; // down module side, moved to m_credits at commit
+    uint64_t m_cycle = 0;
+    size_t m_in_flight = 0;
+    std::deque<uint64_t> m_delivery_cycles{};
+    uint32_t m_trace_id = Trace::kUnregistered;
+    using RemoteEntry = std::pair<uint64_t, connectType>; // delivery cycle, payload
+    std::unique_ptr<Fifo4<RemoteEntry>> m_link = nullptr;
+    std::deque<RemoteEntry> m_inbox{};
+    std::vector<connectType> m_staged{};
+    std::vector<std::vector<connectType>> m_wheel{};
+    size_t m_wheel_mask = 0;
+    RingQueue<connectType> m_ready_fifo{};
 };
 
 
@@ -88,7 +603,7 @@ template<typename T>
 class FactoryBase{
 public:
     void RunOneCycleTop(){
-        std::cout << "RunOneCycleTop " << static_cast<T*>(this)->GetModuleID() << "\n";
+        FACTORY_TRACE(Trace::Debug, cycle_count, GetTraceID(), Trace::CycleStart, 0);
         static_cast<T*>(this)->RunOneCycle();
         cycle_count++;
     }
@@ -99,39 +614,111 @@ public:
     std::string GetModuleID(){
         throw std::runtime_error("Module must implement GetModuleID!");
     }
-    int cycle_count = 0;
+    /// Id used in trace records, the module name is only looked up the first time
+    uint32_t GetTraceID(){
+        if(trace_id == Trace::kUnregistered){
+            trace_id = Trace::Sink::get().registerModule(static_cast<T*>(this)->GetModuleID());
+        }
+        return trace_id;
+    }
+    /// Checkpoint of the cycle and scheduling state, a module adds its own fields by defining
+    /// SaveModuleState/LoadModuleState
+    void SaveState(CheckpointWriter& writer){
+        writer.write(cycle_count);
+        writer.write(activity.IsIdle());
+        writer.write(activity.GetWakeCycle());
+        static_cast<T*>(this)->SaveModuleState(writer);
+    }
+    void LoadState(CheckpointReader& reader){
+        reader.read(cycle_count);
+        auto idle = reader.read<bool>();
+        auto wakeCycle = reader.read<uint64_t>();
+        activity.Restore(idle, wakeCycle);
+        static_cast<T*>(this)->LoadModuleState(reader);
+    }
+    void SaveModuleState(CheckpointWriter&){}
+    void LoadModuleState(CheckpointReader&){}
+
+    /// Runs the module in the given cycle unless it is idle, for schedulers that poll the idle flag
+    /// instead of keeping an active set
+    void PollOneCycle(uint64_t cycle){
+        if(activity.IsIdle() && activity.IsDue(cycle)){
+            activity.Wake();
+        }
+        if(!activity.IsIdle()){
+            cycle_count = cycle; // catch up on the cycles skipped while idle
+            RunOneCycleTop();
+        }
+    }
+    /// Skip this module until one of its input connects delivers data
+    void SleepUntilInput(){
+        activity.Sleep();
+    }
+    /// Skip this module until the given cycle, or until input arrives if that is earlier
+    void SleepUntil(uint64_t cycle){
+        activity.SleepUntil(cycle);
+    }
+    void WakeUp(){
+        activity.Wake();
+    }
+    bool IsIdle() const{
+        return activity.IsIdle();
+    }
+    Activity& GetActivity(){
+        return activity;
+    }
+    uint64_t cycle_count = 0;
+    Activity activity{};
+    uint32_t trace_id = Trace::kUnregistered;
     std::string module_id = "FactoryBase";
 };
 
 class ModuleA: public FactoryBase<ModuleA>{
 public:
     void RunOneCycle(){
-        std::cout << "ModuleA runs one cycle, cycle:" << cycle_count << "\n";
+        FACTORY_TRACE(Trace::Verbose, cycle_count, GetTraceID(), Trace::ModuleARun, 0);
         ModuleBModuleAConnect input{};
         if(m_BtoAConnect->Read(input)){
-            std::cout << "ModuleA receives ModuleBModuleAConnect data" << "\n";
+            FACTORY_TRACE(Trace::Info, cycle_count, GetTraceID(), Trace::ModuleAReceive, input.m_data);
+        }
+        else{
+            SleepUntilInput();
         }
     }
     std::string GetModuleID(){
         return module_id;
     }
-    std::shared_ptr<Connect<ModuleAModuleBConnect, ModuleA, ModuleB>> m_AtoBConnect = nullptr;
-    std::shared_ptr<Connect<ModuleBModuleAConnect, ModuleB, ModuleA>> m_BtoAConnect = nullptr;
+    void Bind(AtoBConnectType* connect){
+        m_AtoBConnect = connect;
+    }
+    void Bind(BtoAConnectType* connect){
+        m_BtoAConnect = connect;
+    }
+    AtoBConnectType* m_AtoBConnect = nullptr;
+    BtoAConnectType* m_BtoAConnect = nullptr;
     std::string module_id = "ModuleA";
 };
 
 class ModuleB: public FactoryBase<ModuleB>{
 public:
     void RunOneCycle(){
-        std::cout << "ModuleB runs one cycle, cycle:" << cycle_count << "\n";
+        FACTORY_TRACE(Trace::Verbose, cycle_count, GetTraceID(), Trace::ModuleBRun, 0);
         ModuleBModuleAConnect input{};
+        input.m_data = cycle_count;
         m_BtoAConnect->Write(input);
+        FACTORY_TRACE(Trace::Info, cycle_count, GetTraceID(), Trace::ModuleBWrite, input.m_data);
     }
     std::string GetModuleID(){
         return module_id;
     }
-    std::shared_ptr<Connect<ModuleAModuleBConnect, ModuleA, ModuleB>> m_AtoBConnect = nullptr;
-    std::shared_ptr<Connect<ModuleBModuleAConnect, ModuleB, ModuleA>> m_BtoAConnect = nullptr;
+    void Bind(AtoBConnectType* connect){
+        m_AtoBConnect = connect;
+    }
+    void Bind(BtoAConnectType* connect){
+        m_BtoAConnect = connect;
+    }
+    AtoBConnectType* m_AtoBConnect = nullptr;
+    BtoAConnectType* m_BtoAConnect = nullptr;
     std::string module_id = "ModuleB";
 };
 
@@ -0,0 +1,204 @@
+//
+// Created by Han on 2024/5/25.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LatencyStats.h"
+#include "LockFreeFifo.h"
+#include "ParallelLib.h"
+#include "Topology.h"
+
+/// Fifo4 ablations, each differs from the default in one knob
+struct NoCachePolicy : Fifo4Policy{
+    static constexpr bool cacheCursors = false;
+};
+struct MaskPolicy : Fifo4Policy{
+    static constexpr bool powerOfTwo = true;
+};
+struct FencePolicy : Fifo4Policy{
+    static constexpr FifoOrder order = FifoOrder::Fences;
+};
+struct SeqCstPolicy : Fifo4Policy{
+    static constexpr FifoOrder order = FifoOrder::SeqCst;
+};
+
+template<size_t Size>
+struct Payload{
+    uint64_t words[Size / 8];
+};
+
+template<class T, class Policy>
+struct Fifo4Adapter{
+    explicit Fifo4Adapter(size_t capacity) : fifo(capacity){}
+    bool push(const T& value){ return fifo.push(value); }
+    bool pop(T& value){ return fifo.pop(value); }
+    Fifo4<T, std::allocator<T>, Policy> fifo;
+};
+
+/// Unbounded, push never fails
+template<class T>
+struct QueueAdapter{
+    explicit QueueAdapter(size_t){}
+    bool push(const T& value){ queue.push_back(value); return true; }
+    bool pop(T& value){ return queue.try_pop(value); }
+    ThreadSafeQueue<T> queue;
+};
+
+struct Placement{
+    std::string name;
+    int producer;
+    int consumer;
+};
+
+/// Unpinned plus every pairing the machine has: one CPU, SMT siblings, two cores of a package and
+/// two packages
+std::vector<Placement> placements(){
+    std::vector<Placement> result{{"unpinned", -1, -1}};
+    const auto& cpus = Topology::get().cpus();
+    if(cpus.empty()){
+        return result;
+    }
+    const auto& first = cpus.front();
+    result.push_back({"same-cpu", first.id, first.id});
+    auto addFirst = [&](const char* name, auto match){
+        for(const auto& other: cpus){
+            if(other.id != first.id && match(other)){
+                result.push_back({name, first.id, other.id});
+                return;
+            }
+        }
+    };
+    addFirst("smt-siblings", [&](const Topology::Cpu& other){
+        return other.package == first.package && other.core == first.core;
+    });
+    addFirst("cross-core", [&](const Topology::Cpu& other){
+        return other.package == first.package && other.core != first.core;
+    });
+    addFirst("cross-socket", [&](const Topology::Cpu& other){
+        return other.package != first.package;
+    });
+    return result;
+}
+
+/// Elements per second from one producer to one consumer
+template<class Queue, class T>
+double throughput(size_t capacity, const Placement& placement, uint64_t items){
+    Queue queue(capacity);
+    auto t1 = std::chrono::steady_clock::now();
+    std::thread producer([&]{
+        pinCurrentThread(placement.producer);
+        T value{};
+        for(uint64_t i = 0; i < items; i++){
+            value.words[0] = i;
+            while(!queue.push(value)){
+                std::this_thread::yield();
+            }
+        }
+    });
+    std::thread consumer([&]{
+        pinCurrentThread(placement.consumer);
+        T value{};
+        for(uint64_t i = 0; i < items; i++){
+            while(!queue.pop(value)){
+                std::this_thread::yield();
+            }
+            if(value.words[0] != i){
+                std::cerr << "out of order\n";
+                std::exit(1);
+            }
+        }
+    });
+    producer.join();
+    consumer.join();
+    auto t2 = std::chrono::steady_clock::now();
+    return items / std::chrono::duration<double>(t2 - t1).count();
+}
+
+/// One element bounced between two threads over a pair of queues, round trips in nanoseconds
+template<class Queue, class T>
+LatencyHistogram roundTrip(size_t capacity, const Placement& placement, uint64_t rounds){
+    Queue there(capacity);
+    Queue back(capacity);
+    LatencyHistogram latency;
+    std::thread echo([&]{
+        pinCurrentThread(placement.consumer);
+        T value{};
+        for(uint64_t i = 0; i < rounds; i++){
+            while(!there.pop(value)){
+                std::this_thread::yield();
+            }
+            while(!back.push(value)){
+                std::this_thread::yield();
+            }
+        }
+    });
+    std::thread ping([&]{
+        pinCurrentThread(placement.producer);
+        T value{};
+        for(uint64_t i = 0; i < rounds; i++){
+            uint64_t start = PoolLatency::now();
+            value.words[0] = i;
+            while(!there.push(value)){
+                std::this_thread::yield();
+            }
+            while(!back.pop(value)){
+                std::this_thread::yield();
+            }
+            latency.record(PoolLatency::now() - start);
+        }
+    });
+    ping.join();
+    echo.join();
+    return latency;
+}
+
+struct Options{
+    uint64_t items;
+    uint64_t rounds;
+};
+
+template<class Queue, class T>
+void runVariant(const std::string& queue, const std::string& variant, size_t capacity,
+                const Placement& placement, const Options& options){
+    double rate = throughput<Queue, T>(capacity, placement, options.items);
+    LatencyHistogram latency = roundTrip<Queue, T>(capacity, placement, options.rounds);
+    std::cout << queue << "," << variant << "," << capacity << "," << sizeof(T) << "," << placement.name << ","
+              << options.items << "," << rate / 1e6 << "," << latency.percentile(0.5) << ","
+              << latency.percentile(0.99) << "," << latency.percentile(0.999) << "," << latency.max() << "\n";
+}
+
+template<size_t Size>
+void runSize(size_t capacity, const Placement& placement, const Options& options){
+    using T = Payload<Size>;
+    runVariant<QueueAdapter<T>, T>("ThreadSafeQueue", "baseline", capacity, placement, options);
+    runVariant<Fifo4Adapter<T, Fifo4Policy>, T>("Fifo4", "default", capacity, placement, options);
+    runVariant<Fifo4Adapter<T, NoCachePolicy>, T>("Fifo4", "no-cursor-cache", capacity, placement, options);
+    runVariant<Fifo4Adapter<T, MaskPolicy>, T>("Fifo4", "power-of-two-mask", capacity, placement, options);
+    runVariant<Fifo4Adapter<T, FencePolicy>, T>("Fifo4", "relaxed-with-fences", capacity, placement, options);
+    runVariant<Fifo4Adapter<T, SeqCstPolicy>, T>("Fifo4", "seq-cst", capacity, placement, options);
+}
+
+/// usage: FifoBenchmark [items] [roundTrips]
+/// One CSV row per queue variant, capacity, element size and thread placement: throughput in
+/// millions of elements per second and round trip latency percentiles in nanoseconds. Capacities
+/// are powers of two so the masking variant holds exactly as many elements as the others.
+int main(int argc, char* argv[]){
+    Options options{argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000,
+                    argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 10000};
+
+    std::cout << "queue,variant,capacity,element_bytes,placement,items,mops,rtt_p50_ns,rtt_p99_ns,rtt_p999_ns,rtt_max_ns\n";
+    for(const auto& placement: placements()){
+        for(size_t capacity: {64, 1024, 16384}){
+            runSize<8>(capacity, placement, options);
+            runSize<64>(capacity, placement, options);
+            runSize<256>(capacity, placement, options);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+//
+// Created by Han on 2024/5/4.
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LockFreeFifo.h"
+
+/// Stress run for Fifo4, MpscFifo and MpmcFifo: every producer pushes a numbered sequence, every
+/// consumer checks that it sees each producer's numbers in increasing order and the totals are
+/// checked at the end. Payloads are strings so construction and destruction of the slots are
+/// covered too. Meant to be run under ThreadSanitizer (cmake -DENABLE_TSAN=ON), exits with 1 on
+/// the first inconsistency.
+
+struct Item{
+    uint32_t producer = 0;
+    uint64_t sequence = 0;
+    std::string payload;
+};
+
+template<class Fifo>
+bool stress(const char* name, int producers, int consumers, uint64_t items, size_t capacity){
+    Fifo fifo(capacity);
+    std::atomic<uint64_t> consumed{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<bool> failed{false};
+    uint64_t total = items * producers;
+
+    std::vector<std::thread> threads;
+    for(int p = 0; p < producers; p++){
+        threads.emplace_back([&fifo, p, items]{
+            for(uint64_t i = 0; i < items; i++){
+                Item item{static_cast<uint32_t>(p), i, std::to_string(i)};
+                while(!fifo.push(std::move(item))){
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for(int c = 0; c < consumers; c++){
+        threads.emplace_back([&, producers]{
+            std::vector<int64_t> last(producers, -1);
+            Item item;
+            while(consumed.load(std::memory_order_relaxed) < total && !failed){
+                if(!fifo.pop(item)){
+                    std::this_thread::yield();
+                    continue;
+                }
+                auto sequence = static_cast<int64_t>(item.sequence);
+                if(sequence <= last[item.producer] || item.payload != std::to_string(item.sequence)){
+                    failed = true;
+                }
+                last[item.producer] = sequence;
+                sum += item.sequence;
+                consumed++;
+            }
+        });
+    }
+    for(auto& thread: threads){
+        thread.join();
+    }
+
+    bool ok = !failed && consumed == total && sum == producers * (items * (items - 1) / 2) && fifo.empty();
+    std::cout << name << " producers " << producers << " consumers " << consumers << " items " << total
+              << (ok ? " ok" : " FAILED") << "\n";
+    return ok;
+}
+
+/// usage: FifoStress [itemsPerProducer] [threads]
+int main(int argc, char* argv[]){
+    uint64_t items = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+
+    bool ok = stress<Fifo4<Item>>("Fifo4", 1, 1, items, 64);
+    ok = stress<MpscFifo<Item>>("MpscFifo", threads, 1, items, 64) && ok;
+    ok = stress<MpmcFifo<Item>>("MpmcFifo", threads, threads, items, 64) && ok;
+    // Odd capacity, the cursors do not wrap on a power of two
+    ok = stress<MpmcFifo<Item>>("MpmcFifo", threads, threads, items, 7) && ok;
+    return ok ? 0 : 1;
+}
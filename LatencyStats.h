@@ -0,0 +1,242 @@
+//
+// Created by Han on 2024/4/20.
+//
+
+#ifndef OPENMP_LATENCYSTATS_H
+#define OPENMP_LATENCYSTATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Log-linear histogram of nanosecond values in the style of HdrHistogram: exact below 64,
+/// then 32 buckets per power of two, so any recorded value is reported within about 3%.
+/// Fixed size and allocation free; record is a few instructions and not thread safe, every
+/// thread records into its own histogram and they are merged for reporting.
+class LatencyHistogram{
+public:
+    static constexpr int kSubBits = 5;
+    static constexpr int kSubCount = 1 << kSubBits;
+    static constexpr int kBuckets = (65 - kSubBits) * kSubCount;
+
+    void record(uint64_t value){
+        m_counts[index(value)]++;
+        m_count++;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+
+    void merge(const LatencyHistogram& other){
+        for(int i = 0; i < kBuckets; i++){
+            m_counts[i] += other.m_counts[i];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    /// Smallest value that at least q (0..1) of the recorded values are below or equal to,
+    /// rounded up to its bucket
+    uint64_t percentile(double q) const{
+        if(m_count == 0){
+            return 0;
+        }
+        auto rank = static_cast<uint64_t>(q * static_cast<double>(m_count) + 0.5);
+        rank = std::min(std::max<uint64_t>(rank, 1), m_count);
+        uint64_t seen = 0;
+        for(int i = 0; i < kBuckets; i++){
+            seen += m_counts[i];
+            if(seen >= rank){
+                return std::min(upperBound(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t count() const{
+        return m_count;
+    }
+    uint64_t max() const{
+        return m_max;
+    }
+    double mean() const{
+        return m_count == 0 ? 0.0 : static_cast<double>(m_sum) / static_cast<double>(m_count);
+    }
+
+    void reset(){
+        m_counts.fill(0);
+        m_count = 0;
+        m_sum = 0;
+        m_max = 0;
+    }
+
+    /// Values below 2 * kSubCount map to themselves, above that the top kSubBits + 1 bits pick
+    /// the bucket
+    static int index(uint64_t value){
+        if(value < 2 * kSubCount){
+            return static_cast<int>(value);
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - kSubBits;
+        return (shift + 1) * kSubCount + static_cast<int>((value >> shift) & (kSubCount - 1));
+    }
+
+    static uint64_t upperBound(int index){
+        if(index < 2 * kSubCount){
+            return static_cast<uint64_t>(index);
+        }
+        int shift = index / kSubCount - 1;
+        uint64_t mantissa = static_cast<uint64_t>(index % kSubCount + kSubCount);
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+private:
+    std::array<uint64_t, kBuckets> m_counts{};
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+};
+
+/// Per-round timings of a thread pool:
+///  - dispatch: from the caller starting a round until the worker starts its job
+///  - run: time spent in each job, i.e. per module for the one-thread-per-module pools
+///  - barrier: from the worker finishing until the caller sees the whole round done
+///  - round: the whole run() call as seen by the caller
+/// Workers only touch their own slot and the caller only reads them after the round barrier,
+/// so nothing here is atomic except the round start stamp. Read or reset only between runs.
+class PoolLatency{
+public:
+    struct alignas(64) Worker{
+        LatencyHistogram dispatch;
+        LatencyHistogram run;
+        LatencyHistogram barrier;
+        uint64_t finished = 0;
+        bool active = false;
+    };
+
+    explicit PoolLatency(int workers = 0){
+        resize(workers);
+    }
+
+    void resize(int workers){
+        while(static_cast<int>(m_workers.size()) < workers){
+            m_workers.emplace_back(new Worker());
+        }
+    }
+
+    static uint64_t now(){
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    /// Caller side, before the round is published to the workers
+    void roundStarted(){
+        m_round_start.store(now(), std::memory_order_relaxed);
+    }
+    /// Caller side, once every worker finished the round
+    void roundFinished(){
+        uint64_t end = now();
+        m_round.record(end - m_round_start.load(std::memory_order_relaxed));
+        for(auto& worker: m_workers){
+            if(worker->active){
+                worker->barrier.record(end > worker->finished ? end - worker->finished : 0);
+                worker->active = false;
+            }
+        }
+    }
+
+    /// Worker side, returns the start stamp for jobFinished
+    uint64_t workerStarted(int worker){
+        uint64_t start = now();
+        uint64_t round = m_round_start.load(std::memory_order_relaxed);
+        m_workers[worker]->dispatch.record(start > round ? start - round : 0);
+        m_workers[worker]->active = true;
+        return start;
+    }
+    /// Worker side, returns the end stamp so back to back jobs need one clock read each
+    uint64_t jobFinished(int worker, uint64_t start){
+        uint64_t end = now();
+        m_workers[worker]->run.record(end - start);
+        return end;
+    }
+    void workerFinished(int worker, uint64_t end){
+        m_workers[worker]->finished = end;
+    }
+
+    int workers() const{
+        return static_cast<int>(m_workers.size());
+    }
+    const Worker& worker(int index) const{
+        return *m_workers[index];
+    }
+    const LatencyHistogram& round() const{
+        return m_round;
+    }
+    LatencyHistogram merged(LatencyHistogram Worker::* metric) const{
+        LatencyHistogram total;
+        for(auto& worker: m_workers){
+            total.merge(*worker.*metric);
+        }
+        return total;
+    }
+
+    void reset(){
+        m_round.reset();
+        for(auto& worker: m_workers){
+            worker->dispatch.reset();
+            worker->run.reset();
+            worker->barrier.reset();
+            worker->active = false;
+        }
+    }
+
+    /// One line per metric and worker with count, mean, p50, p99, p999 and max in microseconds
+    void report(std::ostream& out, const std::string& name) const{
+        out << name << " latency in us\n";
+        out << "  " << std::left << std::setw(24) << "" << std::right;
+        for(const char* column: {"count", "mean", "p50", "p99", "p999", "max"}){
+            out << std::setw(column[0] == 'c' ? 10 : 11) << column;
+        }
+        out << "\n";
+        printLine(out, "round", m_round);
+        printLine(out, "dispatch", merged(&Worker::dispatch));
+        printLine(out, "run", merged(&Worker::run));
+        printLine(out, "barrier", merged(&Worker::barrier));
+        for(int i = 0; i < workers(); i++){
+            std::string index = "[" + std::to_string(i) + "]";
+            printLine(out, "  dispatch" + index, m_workers[i]->dispatch);
+            printLine(out, "  run" + index, m_workers[i]->run);
+            printLine(out, "  barrier" + index, m_workers[i]->barrier);
+        }
+    }
+
+    static void printLine(std::ostream& out, const std::string& label, const LatencyHistogram& histogram){
+        auto us = [](double ns){ return ns / 1000.0; };
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << "  " << std::left << std::setw(24) << label << std::right << std::fixed << std::setprecision(2)
+            << std::setw(10) << histogram.count()
+            << std::setw(11) << us(histogram.mean())
+            << std::setw(11) << us(static_cast<double>(histogram.percentile(0.5)))
+            << std::setw(11) << us(static_cast<double>(histogram.percentile(0.99)))
+            << std::setw(11) << us(static_cast<double>(histogram.percentile(0.999)))
+            << std::setw(11) << us(static_cast<double>(histogram.max())) << "\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    LatencyHistogram m_round;
+    std::atomic<uint64_t> m_round_start{0};
+};
+
+#endif //OPENMP_LATENCYSTATS_H
@@ -7,14 +7,37 @@
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <algorithm>
 #include <memory>
 #include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
 #include <sanitizer/tsan_interface.h>
 
+#include "EventCount.h"
 
-/// Threadsafe, efficient circular FIFO with cached cursors
-template<typename T, typename Alloc = std::allocator<T>>
+
+/// How Fifo4 orders its cursor hand-over: acquire loads and release stores; relaxed accesses
+/// with explicit acquire/release fences; or sequentially consistent accesses. All of them are
+/// correct, they only differ in the instructions emitted.
+enum class FifoOrder { AcquireRelease, Fences, SeqCst };
+
+/// Fifo4 tuning knobs, for ablation studies (see FifoBenchmark). The defaults keep the
+/// original behaviour; with powerOfTwo the capacity is rounded up so indices are masked instead of
+/// divided.
+struct Fifo4Policy
+{
+    static constexpr bool cacheCursors = true;
+    static constexpr bool powerOfTwo = false;
+    static constexpr FifoOrder order = FifoOrder::AcquireRelease;
+};
+
+/// Threadsafe, efficient circular FIFO with cached cursors, for one producer and one consumer.
+/// Wait-free: push and pop finish in a bounded number of steps whatever the other side does.
+template<typename T, typename Alloc = std::allocator<T>, typename Policy = Fifo4Policy>
 class Fifo4 : private Alloc
 {
 public:
@@ -23,10 +46,43 @@ public:
     using size_type = typename allocator_traits::size_type;
     using CursorType = std::atomic<size_type>;
 
+    /// Up to two contiguous runs of slots; the second starts at the beginning of the ring when
+    /// the first one reaches its end
+    class Span
+    {
+    public:
+        Span() = default;
+        Span(T* first, size_type firstSize, T* second, size_type secondSize)
+                : first_{first}, firstSize_{firstSize}, second_{second}, secondSize_{secondSize}
+        {}
+
+        size_type size() const noexcept { return firstSize_ + secondSize_; }
+        bool empty() const noexcept { return size() == 0; }
+        T& operator[](size_type i) const noexcept {
+            return i < firstSize_ ? first_[i] : second_[i - firstSize_];
+        }
+        T* first() const noexcept { return first_; }
+        size_type firstSize() const noexcept { return firstSize_; }
+        T* second() const noexcept { return second_; }
+        size_type secondSize() const noexcept { return secondSize_; }
+
+        /// Only for spans from reserve(): builds slot i in place
+        template<typename... Args>
+        T& construct(size_type i, Args&&... args) {
+            return *new (&(*this)[i]) T(std::forward<Args>(args)...);
+        }
+
+    private:
+        T* first_ = nullptr;
+        size_type firstSize_ = 0;
+        T* second_ = nullptr;
+        size_type secondSize_ = 0;
+    };
+
     explicit Fifo4(size_type capacity, Alloc const& alloc = Alloc{})
             : Alloc{alloc}
-            , capacity_{capacity}
-            , ring_{allocator_traits::allocate(*this, capacity)}
+            , capacity_{Policy::powerOfTwo ? roundUp(capacity) : capacity}
+            , ring_{allocator_traits::allocate(*this, capacity_)}
     {}
 
     ~Fifo4() {
@@ -59,42 +115,109 @@ public:
     /// Push one object onto the fifo.
     /// @return `true` if the operation is successful; `false` if fifo is full.
     bool push(T const& value) {
+        return try_emplace(value);
+    }
+    bool push(T&& value) {
+        return try_emplace(std::move(value));
+    }
+
+    /// Construct one object in place at the back of the fifo.
+    /// @return `true` if the operation is successful; `false` if fifo is full.
+    template<typename... Args>
+    bool try_emplace(Args&&... args) {
         auto pushCursor = pushCursor_.load(std::memory_order_relaxed);
-        if (full(pushCursor, popCursorCached_)) {
-            popCursorCached_ = popCursor_.load(std::memory_order_acquire);
-            // popCursorCached_ = popCursor_.load(std::memory_order_relaxed);
+        if (!Policy::cacheCursors || full(pushCursor, popCursorCached_)) {
+            popCursorCached_ = loadOther(popCursor_);
             if (full(pushCursor, popCursorCached_)) {
                 return false;
             }
         }
 
-        //__tsan_acquire(&popCursor_);
-        // std::atomic_thread_fence(std::memory_order_acquire);
-        new (element(pushCursor)) T(value);
-        pushCursor_.store(pushCursor + 1, std::memory_order_release);
+        new (element(pushCursor)) T(std::forward<Args>(args)...);
+        publish(pushCursor_, pushCursor + 1);
         return true;
     }
 
-    /// Pop one object from the fifo.
+    /// Pop one object from the fifo, moving it into value.
     /// @return `true` if the pop operation is successful; `false` if fifo is empty.
     bool pop(T& value) {
         auto popCursor = popCursor_.load(std::memory_order_relaxed);
-        if (empty(pushCursorCached_, popCursor)) {
-            pushCursorCached_ = pushCursor_.load(std::memory_order_acquire);
-            // pushCursorCached_ = pushCursor_.load(std::memory_order_relaxed);
+        if (!Policy::cacheCursors || empty(pushCursorCached_, popCursor)) {
+            pushCursorCached_ = loadOther(pushCursor_);
             if (empty(pushCursorCached_, popCursor)) {
                 return false;
             }
         }
 
-        // __tsan_acquire(&pushCursor_);
-        // std::atomic_thread_fence(std::memory_order_acquire);
-        value = *element(popCursor);
+        value = std::move(*element(popCursor));
         element(popCursor)->~T();
-        popCursor_.store(popCursor + 1, std::memory_order_release);
+        publish(popCursor_, popCursor + 1);
         return true;
     }
 
+    /// Producer side: hands out up to max free slots as raw storage, to be built with
+    /// Span::construct (or plain stores for trivial types) and published with commit. Only one
+    /// reservation may be outstanding.
+    /// @return an empty span if the fifo is full.
+    Span reserve(size_type max) {
+        auto pushCursor = pushCursor_.load(std::memory_order_relaxed);
+        if (!Policy::cacheCursors || capacity_ - (pushCursor - popCursorCached_) < max) {
+            popCursorCached_ = loadOther(popCursor_);
+        }
+        return span(pushCursor, std::min(max, capacity_ - (pushCursor - popCursorCached_)));
+    }
+
+    /// Publishes the first count slots of the last reservation, all of them constructed, with a
+    /// single cursor store
+    void commit(size_type count) {
+        auto pushCursor = pushCursor_.load(std::memory_order_relaxed);
+        assert(count <= capacity_ - (pushCursor - popCursorCached_));
+        publish(pushCursor_, pushCursor + count);
+    }
+
+    /// Consumer side: up to max elements at the front, left in the fifo until release
+    /// @return an empty span if the fifo is empty.
+    Span peek(size_type max) {
+        auto popCursor = popCursor_.load(std::memory_order_relaxed);
+        if (!Policy::cacheCursors || pushCursorCached_ - popCursor < max) {
+            pushCursorCached_ = loadOther(pushCursor_);
+        }
+        return span(popCursor, std::min(max, pushCursorCached_ - popCursor));
+    }
+
+    /// Destroys the first count elements of the last peek and frees their slots with a single
+    /// cursor store
+    void release(size_type count) {
+        auto popCursor = popCursor_.load(std::memory_order_relaxed);
+        assert(count <= pushCursorCached_ - popCursor);
+        for (size_type i = 0; i < count; ++i) {
+            element(popCursor + i)->~T();
+        }
+        publish(popCursor_, popCursor + count);
+    }
+
+    /// Copies up to count values in, publishing them at once.
+    /// @return the number of values pushed.
+    size_type push_bulk(T const* values, size_type count) {
+        Span slots = reserve(count);
+        for (size_type i = 0; i < slots.size(); ++i) {
+            slots.construct(i, values[i]);
+        }
+        commit(slots.size());
+        return slots.size();
+    }
+
+    /// Moves up to count values out, freeing their slots at once.
+    /// @return the number of values popped.
+    size_type pop_bulk(T* values, size_type count) {
+        Span elements = peek(count);
+        for (size_type i = 0; i < elements.size(); ++i) {
+            values[i] = std::move(elements[i]);
+        }
+        release(elements.size());
+        return elements.size();
+    }
+
 private:
     bool full(size_type pushCursor, size_type popCursor) const noexcept {
         return (pushCursor - popCursor) == capacity_;
@@ -102,8 +225,59 @@ private:
     static bool empty(size_type pushCursor, size_type popCursor) noexcept {
         return pushCursor == popCursor;
     }
+    size_type index(size_type cursor) const noexcept {
+        return Policy::powerOfTwo ? cursor & (capacity_ - 1) : cursor % capacity_;
+    }
     T* element(size_type cursor) noexcept {
-        return &ring_[cursor % capacity_];
+        return &ring_[index(cursor)];
+    }
+    Span span(size_type cursor, size_type count) noexcept {
+        size_type index = this->index(cursor);
+        size_type first = std::min(count, capacity_ - index);
+        return Span{ring_ + index, first, ring_, count - first};
+    }
+
+    static size_type roundUp(size_type capacity) noexcept {
+        size_type size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    /// Reads the other side's cursor, everything it published before is visible afterwards
+    static size_type loadOther(CursorType const& cursor) noexcept {
+        if constexpr (Policy::order == FifoOrder::Fences) {
+            auto value = cursor.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+#if defined(__SANITIZE_THREAD__)
+            // ThreadSanitizer does not model fences
+            __tsan_acquire(const_cast<CursorType*>(&cursor));
+#endif
+            return value;
+        }
+        else if constexpr (Policy::order == FifoOrder::SeqCst) {
+            return cursor.load(std::memory_order_seq_cst);
+        }
+        else {
+            return cursor.load(std::memory_order_acquire);
+        }
+    }
+    /// Moves this side's cursor, publishing the slots written or freed before
+    static void publish(CursorType& cursor, size_type value) noexcept {
+        if constexpr (Policy::order == FifoOrder::Fences) {
+#if defined(__SANITIZE_THREAD__)
+            __tsan_release(&cursor);
+#endif
+            std::atomic_thread_fence(std::memory_order_release);
+            cursor.store(value, std::memory_order_relaxed);
+        }
+        else if constexpr (Policy::order == FifoOrder::SeqCst) {
+            cursor.store(value, std::memory_order_seq_cst);
+        }
+        else {
+            cursor.store(value, std::memory_order_release);
+        }
     }
 
 private:
@@ -116,13 +290,13 @@ private:
     static constexpr auto hardware_destructive_interference_size = size_type{64};
 
     /// Loaded and stored by the push thread; loaded by the pop thread
-    alignas(hardware_destructive_interference_size) CursorType pushCursor_;
+    alignas(hardware_destructive_interference_size) CursorType pushCursor_{0};
 
     /// Exclusive to the push thread
     alignas(hardware_destructive_interference_size) size_type popCursorCached_{};
 
     /// Loaded and stored by the pop thread; loaded by the push thread
-    alignas(hardware_destructive_interference_size) CursorType popCursor_;
+    alignas(hardware_destructive_interference_size) CursorType popCursor_{0};
 
     /// Exclusive to the pop thread
     alignas(hardware_destructive_interference_size) size_type pushCursorCached_{};
@@ -131,4 +305,383 @@ private:
     char padding_[hardware_destructive_interference_size - sizeof(size_type)];
 };
 
+/// Fifo4 whose consumer can park while it is empty and whose producer can park while it is full.
+/// pop_wait and push_wait spin for the wait strategy's spin time, then sleep on an eventcount
+/// until the other side moves or the timeout passes. Every operation that adds or frees
+/// elements notifies the other side, which is a fence and a load while nobody is parked.
+template<typename T, typename Alloc = std::allocator<T>, typename Policy = Fifo4Policy>
+class BlockingFifo4 : private Fifo4<T, Alloc, Policy>
+{
+    using Base = Fifo4<T, Alloc, Policy>;
+
+public:
+    using typename Base::value_type;
+    using typename Base::size_type;
+    using typename Base::Span;
+
+    explicit BlockingFifo4(size_type capacity, Alloc const& alloc = Alloc{}, WaitStrategy wait = WaitStrategy{})
+            : Base{capacity, alloc}
+            , wait_{wait}
+    {}
+
+    using Base::size;
+    using Base::capacity;
+    bool empty() const noexcept { return Base::empty(); }
+    bool full() const noexcept { return Base::full(); }
+    using Base::reserve;
+    using Base::peek;
+
+    bool push(T const& value) { return try_emplace(value); }
+    bool push(T&& value) { return try_emplace(std::move(value)); }
+
+    template<typename... Args>
+    bool try_emplace(Args&&... args) {
+        if (!Base::try_emplace(std::forward<Args>(args)...)) {
+            return false;
+        }
+        notEmpty_.notifyAll();
+        return true;
+    }
+
+    bool pop(T& value) {
+        if (!Base::pop(value)) {
+            return false;
+        }
+        notFull_.notifyAll();
+        return true;
+    }
+
+    void commit(size_type count) {
+        Base::commit(count);
+        notEmpty_.notifyAll();
+    }
+
+    void release(size_type count) {
+        Base::release(count);
+        notFull_.notifyAll();
+    }
+
+    /// Pop one object, waiting up to timeout for one to arrive.
+    /// @return `true` if the pop operation is successful; `false` if the fifo stayed empty.
+    template<typename Rep, typename Period>
+    bool pop_wait(T& value, std::chrono::duration<Rep, Period> timeout) {
+        if (pop(value)) {
+            return true;
+        }
+        auto deadline = deadlineAfter(timeout);
+        while (wait_.waitUntil(notEmpty_, [this]{ return !Base::empty(); }, deadline)) {
+            if (pop(value)) {
+                return true;
+            }
+        }
+        return pop(value);
+    }
+
+    /// Push one object, waiting up to timeout for a free slot.
+    /// @return `true` if the operation is successful; `false` if the fifo stayed full.
+    template<typename Rep, typename Period>
+    bool push_wait(T const& value, std::chrono::duration<Rep, Period> timeout) {
+        return emplace_wait(timeout, value);
+    }
+    template<typename Rep, typename Period>
+    bool push_wait(T&& value, std::chrono::duration<Rep, Period> timeout) {
+        return emplace_wait(timeout, std::move(value));
+    }
+
+private:
+    template<typename Rep, typename Period, typename... Args>
+    bool emplace_wait(std::chrono::duration<Rep, Period> timeout, Args&&... args) {
+        if (try_emplace(std::forward<Args>(args)...)) {
+            return true;
+        }
+        auto deadline = deadlineAfter(timeout);
+        while (wait_.waitUntil(notFull_, [this]{ return !Base::full(); }, deadline)) {
+            // Only the producer pushes, so this cannot fail once the fifo is not full
+            if (try_emplace(std::forward<Args>(args)...)) {
+                return true;
+            }
+        }
+        return try_emplace(std::forward<Args>(args)...);
+    }
+
+    /// Saturates instead of overflowing for very long timeouts
+    template<typename Rep, typename Period>
+    static std::chrono::steady_clock::time_point deadlineAfter(std::chrono::duration<Rep, Period> timeout) {
+        auto now = std::chrono::steady_clock::now();
+        if (timeout >= std::chrono::steady_clock::time_point::max() - now) {
+            return std::chrono::steady_clock::time_point::max();
+        }
+        return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    }
+
+private:
+    WaitStrategy wait_;
+    EventCount notEmpty_;
+    EventCount notFull_;
+};
+
+/// Ring slot of SequencedRing: the sequence number says whose turn the slot is.
+/// At ring position p it is p while free, p + 1 once written and p + capacity once read again.
+template<typename T>
+struct SequencedSlot
+{
+    std::atomic<size_t> sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T* get() noexcept { return reinterpret_cast<T*>(&storage); }
+};
+
+/// Bounded ring of sequenced slots (Vyukov's design), the one implementation behind MpscFifo,
+/// MpmcFifo and LockFreeQueue. Producers claim a position with a CAS on the push cursor and
+/// publish through the slot's sequence number; consumers either claim with a CAS (pop_bulk) or,
+/// when there is only one of them, simply store the pop cursor (pop_single). Sequences are
+/// compared as signed differences so the cursors may wrap. With powerOfTwo the capacity is rounded
+/// up so positions are masked instead of divided.
+template<typename T, typename Alloc = std::allocator<T>, bool powerOfTwo = false>
+class SequencedRing : private std::allocator_traits<Alloc>::template rebind_alloc<SequencedSlot<T>>
+{
+public:
+    using value_type = T;
+    using Slot = SequencedSlot<T>;
+    using SlotAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Slot>;
+    using allocator_traits = std::allocator_traits<SlotAlloc>;
+    using size_type = typename allocator_traits::size_type;
+    using CursorType = std::atomic<size_type>;
+
+    /// A slot is free again at position + capacity, so fewer than two slots cannot tell a free
+    /// slot from a written one
+    explicit SequencedRing(size_type capacity, Alloc const& alloc = Alloc{})
+            : SlotAlloc{alloc}
+            , capacity_{checked(powerOfTwo ? roundUp(capacity) : capacity)}
+            , ring_{allocator_traits::allocate(*this, capacity_)}
+    {
+        for (size_type i = 0; i < capacity_; ++i) {
+            allocator_traits::construct(*this, ring_ + i);
+            ring_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    SequencedRing(SequencedRing const&) = delete;
+    SequencedRing& operator=(SequencedRing const&) = delete;
+
+    ~SequencedRing() {
+        for (auto cursor = popCursor_.load(); slot(cursor).sequence.load() == cursor + 1; ++cursor) {
+            slot(cursor).get()->~T();
+        }
+        for (size_type i = 0; i < capacity_; ++i) {
+            allocator_traits::destroy(*this, ring_ + i);
+        }
+        allocator_traits::deallocate(*this, ring_, capacity_);
+    }
+
+    /// Returns the number of claimed elements, exact only while nobody pushes or pops
+    size_type size() const noexcept {
+        auto popCursor = popCursor_.load(std::memory_order_acquire);
+        auto pushCursor = pushCursor_.load(std::memory_order_acquire);
+        return pushCursor > popCursor ? pushCursor - popCursor : 0;
+    }
+
+    /// Snapshots of the next slot: empty while it is not published yet, full while it is not
+    /// freed yet, so a claimed but unfinished slot counts as neither
+    bool empty() const noexcept {
+        auto popCursor = popCursor_.load(std::memory_order_acquire);
+        return before(slot(popCursor).sequence.load(std::memory_order_acquire), popCursor + 1);
+    }
+    bool full() const noexcept {
+        auto pushCursor = pushCursor_.load(std::memory_order_acquire);
+        return before(slot(pushCursor).sequence.load(std::memory_order_acquire), pushCursor);
+    }
+    size_type capacity() const noexcept { return capacity_; }
+
+    /// Builds one object in the next free slot, from any thread.
+    /// @return `true` if the operation is successful; `false` if the ring is full.
+    template<typename... Args>
+    bool try_emplace(Args&&... args) {
+        auto pushCursor = pushCursor_.load(std::memory_order_relaxed);
+        Slot* claimed;
+        while (true) {
+            claimed = &slot(pushCursor);
+            auto sequence = claimed->sequence.load(std::memory_order_acquire);
+            if (sequence == pushCursor) {
+                if (pushCursor_.compare_exchange_weak(pushCursor, pushCursor + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (before(sequence, pushCursor)) {
+                return false;
+            }
+            else {
+                pushCursor = pushCursor_.load(std::memory_order_relaxed);
+            }
+        }
+        new (claimed->get()) T(std::forward<Args>(args)...);
+        claimed->sequence.store(pushCursor + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Pops up to max objects into out with a single claim on the pop cursor, from any thread.
+    /// @return the number of objects popped, 0 if the ring is empty
+    size_type pop_bulk(T* out, size_type max) {
+        auto popCursor = popCursor_.load(std::memory_order_relaxed);
+        size_type count;
+        while (true) {
+            count = 0;
+            while (count < max && slot(popCursor + count).sequence.load(std::memory_order_acquire) == popCursor + count + 1) {
+                ++count;
+            }
+            if (count == 0) {
+                if (before(slot(popCursor).sequence.load(std::memory_order_acquire), popCursor + 1)) {
+                    return 0;
+                }
+                // Another consumer got there first
+                popCursor = popCursor_.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (popCursor_.compare_exchange_weak(popCursor, popCursor + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        for (size_type i = 0; i < count; ++i) {
+            take(popCursor + i, out[i]);
+        }
+        return count;
+    }
+
+    /// Pops one object, only when a single thread ever pops: no CAS on the pop cursor.
+    /// @return `true` if the pop operation is successful; `false` if the ring is empty.
+    bool pop_single(T& value) {
+        auto popCursor = popCursor_.load(std::memory_order_relaxed);
+        if (slot(popCursor).sequence.load(std::memory_order_acquire) != popCursor + 1) {
+            return false;
+        }
+        take(popCursor, value);
+        popCursor_.store(popCursor + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    Slot& slot(size_type position) const noexcept {
+        return ring_[powerOfTwo ? position & (capacity_ - 1) : position % capacity_];
+    }
+
+    void take(size_type position, T& value) {
+        Slot& taken = slot(position);
+        value = std::move(*taken.get());
+        taken.get()->~T();
+        taken.sequence.store(position + capacity_, std::memory_order_release);
+    }
+
+    static bool before(size_type sequence, size_type position) noexcept {
+        return static_cast<std::make_signed_t<size_type>>(sequence - position) < 0;
+    }
+
+    static size_type checked(size_type capacity) {
+        if (capacity < 2) {
+            throw std::invalid_argument("SequencedRing needs a capacity of at least 2");
+        }
+        return capacity;
+    }
+
+    static size_type roundUp(size_type capacity) noexcept {
+        size_type size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    size_type capacity_;
+    Slot* ring_;
+
+    static constexpr auto hardware_destructive_interference_size = size_type{64};
+
+    /// Claimed by producers with a CAS
+    alignas(hardware_destructive_interference_size) CursorType pushCursor_{0};
+
+    /// Claimed by consumers with a CAS, or stored by the only consumer
+    alignas(hardware_destructive_interference_size) CursorType popCursor_{0};
+
+    // Padding to avoid false sharing with adjacent objects
+    char padding_[hardware_destructive_interference_size - sizeof(CursorType)];
+};
+
+/// Circular FIFO for any number of producers and one consumer, same interface as Fifo4.
+/// Producers claim a position with a CAS on the push cursor and publish through the slot's
+/// sequence number, so the consumer never writes a shared producer line except to free a slot.
+/// Progress: nobody ever blocks or takes a lock; a failed producer CAS means another producer
+/// succeeded (lock-free), pop is wait-free. A producer preempted between claiming and publishing
+/// its slot makes pop report empty until it resumes, even if later slots are filled.
+/// Throws std::invalid_argument for a capacity below 2.
+template<typename T, typename Alloc = std::allocator<T>>
+class MpscFifo
+{
+public:
+    using value_type = T;
+    using size_type = typename SequencedRing<T, Alloc>::size_type;
+
+    explicit MpscFifo(size_type capacity, Alloc const& alloc = Alloc{})
+            : ring_{capacity, alloc}
+    {}
+
+    /// Returns the number of elements in the fifo, exact only while nobody pushes or pops
+    size_type size() const noexcept { return ring_.size(); }
+    bool empty() const noexcept { return ring_.empty(); }
+    bool full() const noexcept { return ring_.full(); }
+    size_type capacity() const noexcept { return ring_.capacity(); }
+
+    /// Push one object onto the fifo, from any thread.
+    /// @return `true` if the operation is successful; `false` if fifo is full.
+    bool push(T const& value) { return ring_.try_emplace(value); }
+    bool push(T&& value) { return ring_.try_emplace(std::move(value)); }
+
+    template<typename... Args>
+    bool try_emplace(Args&&... args) { return ring_.try_emplace(std::forward<Args>(args)...); }
+
+    /// Pop one object from the fifo, only from the consumer thread.
+    /// @return `true` if the pop operation is successful; `false` if fifo is empty.
+    bool pop(T& value) { return ring_.pop_single(value); }
+
+private:
+    SequencedRing<T, Alloc> ring_;
+};
+
+/// Circular FIFO for any number of producers and consumers, same interface as Fifo4; both
+/// cursors are claimed with a CAS and slots are handed over through their sequence numbers.
+/// Progress: nobody ever blocks or takes a lock and a failed CAS means another thread succeeded
+/// (lock-free). A producer preempted between claiming and publishing makes pop report empty at
+/// that slot, a consumer preempted between claiming and freeing makes push report full, until
+/// the thread resumes. Throws std::invalid_argument for a capacity below 2.
+template<typename T, typename Alloc = std::allocator<T>>
+class MpmcFifo
+{
+public:
+    using value_type = T;
+    using size_type = typename SequencedRing<T, Alloc>::size_type;
+
+    explicit MpmcFifo(size_type capacity, Alloc const& alloc = Alloc{})
+            : ring_{capacity, alloc}
+    {}
+
+    /// Returns the number of elements in the fifo, exact only while nobody pushes or pops
+    size_type size() const noexcept { return ring_.size(); }
+    bool empty() const noexcept { return ring_.empty(); }
+    bool full() const noexcept { return ring_.full(); }
+    size_type capacity() const noexcept { return ring_.capacity(); }
+
+    /// Push one object onto the fifo, from any thread.
+    /// @return `true` if the operation is successful; `false` if fifo is full.
+    bool push(T const& value) { return ring_.try_emplace(value); }
+    bool push(T&& value) { return ring_.try_emplace(std::move(value)); }
+
+    template<typename... Args>
+    bool try_emplace(Args&&... args) { return ring_.try_emplace(std::forward<Args>(args)...); }
+
+    /// Pop one object from the fifo, from any thread.
+    /// @return `true` if the pop operation is successful; `false` if fifo is empty.
+    bool pop(T& value) { return ring_.pop_bulk(&value, 1) == 1; }
+
+private:
+    SequencedRing<T, Alloc> ring_;
+};
+
 #endif //OPENMP_LOCKFREEFIFO_H
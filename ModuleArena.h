@@ -0,0 +1,105 @@
+//
+// Created by Han on 2024/4/6.
+//
+
+#ifndef OPENMP_MODULEARENA_H
+#define OPENMP_MODULEARENA_H
+
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/// Stores modules of one type in fixed size contiguous blocks, the same layout
+/// compactMemoryAllocation() gets from std::array, but growable. Addresses never change once
+/// a module is created, so connects can keep raw pointers to them. A NodeAllocator puts the
+/// blocks on the NUMA node of the worker stepping them.
+template<class T, size_t BlockSize = 256, class Alloc = std::allocator<T>>
+class ModuleArena{
+public:
+    static constexpr size_t kBlockSize = BlockSize;
+
+    explicit ModuleArena(const Alloc& allocator = Alloc()) : m_allocator(allocator){}
+    ModuleArena(const ModuleArena&) = delete;
+    ModuleArena& operator=(const ModuleArena&) = delete;
+
+    ~ModuleArena(){
+        for(size_t i = 0; i < m_size; i++){
+            (*this)[i].~T();
+        }
+        for(T* block: m_blocks){
+            m_allocator.deallocate(block, BlockSize);
+        }
+    }
+
+    template<class... Args>
+    T* create(Args&&... args){
+        if(m_size == m_blocks.size() * BlockSize){
+            m_blocks.push_back(m_allocator.allocate(BlockSize));
+        }
+        T* module = &m_blocks.back()[m_size % BlockSize];
+        new (module) T(std::forward<Args>(args)...);
+        m_size++;
+        return module;
+    }
+
+    T& operator[](size_t index){
+        return m_blocks[index / BlockSize][index % BlockSize];
+    }
+
+    size_t size() const{
+        return m_size;
+    }
+
+    size_t blockCount() const{
+        return m_blocks.size();
+    }
+
+    /// Modules of one block, contiguous in memory
+    std::pair<T*, T*> block(size_t index){
+        T* begin = m_blocks[index];
+        size_t count = index + 1 < m_blocks.size() ? BlockSize : m_size - index * BlockSize;
+        return {begin, begin + count};
+    }
+
+    template<class F>
+    void forEach(F&& func){
+        for(size_t i = 0; i < m_blocks.size(); i++){
+            auto range = block(i);
+            for(T* module = range.first; module != range.second; module++){
+                func(*module);
+            }
+        }
+    }
+
+private:
+    Alloc m_allocator;
+    std::vector<T*> m_blocks;
+    size_t m_size = 0;
+};
+
+/// One arena per module type, e.g. ModuleStore<ModuleA, ModuleB>
+template<class... Modules>
+class ModuleStore{
+public:
+    template<class T, class... Args>
+    T* create(Args&&... args){
+        return std::get<ModuleArena<T>>(m_arenas).create(std::forward<Args>(args)...);
+    }
+
+    template<class T>
+    ModuleArena<T>& arena(){
+        return std::get<ModuleArena<T>>(m_arenas);
+    }
+
+    /// Calls func once per arena, so each type is iterated in its own statically dispatched loop
+    template<class F>
+    void forEachArena(F&& func){
+        std::apply([&func](ModuleArena<Modules>&... arena){ (func(arena), ...); }, m_arenas);
+    }
+
+private:
+    std::tuple<ModuleArena<Modules>...> m_arenas;
+};
+
+#endif //OPENMP_MODULEARENA_H
@@ -0,0 +1,75 @@
+//
+// Created by Han on 2024/4/6.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CycleEngine.h"
+#include "ModuleArena.h"
+
+/// Synthetic module with a bit of state to touch every cycle
+class BenchModule: public FactoryBase<BenchModule>{
+public:
+    void RunOneCycle(){
+        for(auto& value: m_state){
+            value = value * 6364136223846793005ULL + cycle_count;
+        }
+    }
+    std::string GetModuleID(){
+        return "BenchModule";
+    }
+    uint64_t m_state[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+};
+
+template<class Setup>
+double cyclesPerSecond(int threads, uint64_t cycles, Setup setup){
+    CycleEngine engine(threads);
+    setup(engine);
+    engine.run(cycles / 10); // warm up
+    auto t1 = std::chrono::high_resolution_clock::now();
+    engine.run(cycles);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return cycles / std::chrono::duration<double>(t2 - t1).count();
+}
+
+/// usage: ModuleLayoutBenchmark [modules] [cycles] [threads]
+int main(int argc, char* argv[]){
+    size_t modules = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000;
+    uint64_t cycles = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000;
+    int threads = argc > 3 ? std::atoi(argv[3]) : 1;
+
+    // One heap object per module, interleaved with other allocations like in a real model
+    std::vector<std::shared_ptr<BenchModule>> scattered;
+    std::vector<std::unique_ptr<char[]>> noise;
+    for(size_t i = 0; i < modules; i++){
+        scattered.push_back(std::make_shared<BenchModule>());
+        noise.emplace_back(new char[16 + rand() % 512]);
+    }
+    ModuleArena<BenchModule> arena;
+    for(size_t i = 0; i < modules; i++){
+        arena.create();
+    }
+
+    double shared = cyclesPerSecond(threads, cycles, [&](CycleEngine& engine){
+        for(auto& module: scattered){
+            engine.registerModule(module.get());
+        }
+    });
+    double arenaSingle = cyclesPerSecond(threads, cycles, [&](CycleEngine& engine){
+        arena.forEach([&engine](BenchModule& module){ engine.registerModule(&module); });
+    });
+    double arenaGroup = cyclesPerSecond(threads, cycles, [&](CycleEngine& engine){
+        engine.registerModuleGroup(arena);
+    });
+
+    std::cout << "modules " << modules << ", cycles " << cycles << ", threads " << threads << "\n";
+    std::cout << "make_shared, per module entry: " << shared << " cycles/s\n";
+    std::cout << "arena, per module entry:       " << arenaSingle << " cycles/s\n";
+    std::cout << "arena, per block group:        " << arenaGroup << " cycles/s\n";
+    return 0;
+}
@@ -5,11 +5,15 @@
 #ifndef OPENMP_PARALLELLIB_H
 #define OPENMP_PARALLELLIB_H
 
+#include <atomic>
+#include <cassert>
 #include <deque>
 #include <chrono>
 #include <memory>
+#include <new>
 #include <mutex>
 #include <future>
+#include <thread>
 #include <string>
 #include <condition_variable>
 #include <fstream>
@@ -20,6 +24,17 @@
 #include <iostream>
 #include <algorithm>
 #include <numeric>
+#include <functional>
+#include <climits>
+#include <cstddef>
+#include <type_traits>
+#include <cstdint>
+#include <exception>
+
+#include "EventCount.h"
+#include "LatencyStats.h"
+#include "LockFreeFifo.h"
+#include "Topology.h"
 
 // Simple thread safe queue with lock and conditional variable
 template<typename T>
@@ -75,164 +90,888 @@ public:
     }
 };
 
+/// Bounded lock-free MPMC ring with the interface of ThreadSafeQueue, on the SequencedRing
+/// behind MpmcFifo: every slot carries a sequence number telling producers and consumers whose
+/// turn it is (Vyukov's design), so a push or pop is one CAS on the shared cursor plus one store
+/// to the slot. Values are moved in and out, so move-only types work. wait_and_pop and a
+/// push_back into a full queue spin then park, and the other side only makes a system call when
+/// somebody is actually parked.
+/// Not copyable, unlike ThreadSafeQueue.
+template<typename T>
+class LockFreeQueue{
+public:
+    /// capacity is rounded up to a power of two, at least 2
+    explicit LockFreeQueue(size_t capacity = 1024, WaitStrategy wait = WaitStrategy{})
+        : m_ring(std::max<size_t>(capacity, 2))
+        , m_wait(wait){}
+    LockFreeQueue(const LockFreeQueue&) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+    // blocks while the queue is full
+    void push_back(T data){
+        while(!try_push(data)){
+            m_wait.wait(m_not_full, [this]{ return !full(); });
+        }
+    }
+    // returns immediately, data is left untouched when FALSE is returned
+    bool try_push(T& data){
+        if(!m_ring.try_emplace(std::move(data))){
+            return false;
+        }
+        m_not_empty.notifyAll();
+        return true;
+    }
+    bool try_push(T&& data){
+        return try_push(data);
+    }
+
+    // the thread calling this will be blocked until !queue.empty()
+    void wait_and_pop(T& value){
+        while(!try_pop(value)){
+            m_wait.wait(m_not_empty, [this]{ return !empty(); });
+        }
+    }
+    // returns immediately, value only valid when TRUE is returned
+    bool try_pop(T& value){
+        return try_pop_bulk(&value, 1) == 1;
+    }
+    // pops up to max values into out with a single claim on the shared cursor, returns how many
+    size_t try_pop_bulk(T* out, size_t max){
+        size_t count = m_ring.pop_bulk(out, max);
+        if(count > 0){
+            m_not_full.notifyAll();
+        }
+        return count;
+    }
+
+    // a snapshot, other threads may change it right away
+    bool empty() const{
+        return m_ring.empty();
+    }
+    bool full() const{
+        return m_ring.full();
+    }
+    size_t capacity() const{
+        return m_ring.capacity();
+    }
+
+private:
+    SequencedRing<T, std::allocator<T>, true> m_ring;
+    alignas(64) EventCount m_not_empty;
+    EventCount m_not_full;
+    WaitStrategy m_wait;
+};
+
+/// Sense reversing barrier: arrivals only touch one counter, the last one flips the shared sense
+/// and resets the counter, so no thread scans per-participant flags
+class SenseBarrier{
+public:
+    explicit SenseBarrier(int participants = 0, WaitStrategy wait = WaitStrategy{})
+        : m_participants(participants), m_remaining(participants), m_wait(wait){}
+
+    /// Only while no phase is in progress
+    void setParticipants(int participants){
+        m_participants = participants;
+        m_remaining.store(participants, std::memory_order_relaxed);
+    }
+    /// localSense is per participant and starts out as sense(): false for the first phase, the
+    /// current sense for a participant added later
+    void arrive(bool& localSense){
+        localSense = !localSense;
+        if(m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            m_remaining.store(m_participants, std::memory_order_relaxed);
+            m_sense.store(localSense, std::memory_order_release);
+            m_event.notifyAll();
+        }
+    }
+    void arriveAndWait(bool& localSense){
+        arrive(localSense);
+        bool sense = localSense;
+        m_wait.wait(m_event, [this, sense]{ return m_sense.load(std::memory_order_acquire) == sense; });
+    }
+    /// Sense of the last completed phase
+    bool sense() const{
+        return m_sense.load(std::memory_order_acquire);
+    }
+private:
+    int m_participants;
+    alignas(64) std::atomic<int> m_remaining;
+    alignas(64) std::atomic<bool> m_sense{false};
+    EventCount m_event;
+    WaitStrategy m_wait;
+};
+
+/// Start/finish handshake between the thread calling run() and a fixed set of workers.
+/// Workers spin then park on a shared eventcount until the generation changes; finishing a
+/// round goes through a SenseBarrier that only the master waits on, so no worker is woken by
+/// another worker finishing.
+class RoundDispatcher{
+public:
+    explicit RoundDispatcher(WaitStrategy wait = WaitStrategy{}) : m_wait(wait), m_done(1, wait){}
+
+    /// Before the first round or between rounds. The new worker starts from generation() and
+    /// sense(), read right after this call.
+    void addWorker(){
+        m_workers++;
+        m_done.setParticipants(m_workers + 1);
+    }
+    /// Master side: starts a round and returns once every worker finished it
+    void runRound(){
+        startRound();
+        waitRound();
+    }
+    /// Split form of runRound, for a master that does work of its own in between
+    void startRound(){
+        m_generation.fetch_add(1, std::memory_order_release);
+        m_start.notifyAll();
+    }
+    void waitRound(){
+        m_done.arriveAndWait(m_master_sense);
+    }
+    /// Worker side: waits for the round after lastGeneration, false once stopped
+    bool waitForRound(uint32_t& lastGeneration){
+        m_wait.wait(m_start, [this, lastGeneration]{
+            return m_generation.load(std::memory_order_acquire) != lastGeneration ||
+                   !m_running.load(std::memory_order_acquire);
+        });
+        lastGeneration = m_generation.load(std::memory_order_acquire);
+        return m_running.load(std::memory_order_acquire);
+    }
+    /// Like waitForRound, but runs side tasks while there is no round: runTask runs one task and
+    /// returns false if there was none, hasTask tells a parked worker to get up. A round starts
+    /// once the task in progress is done. Whoever queues a task calls wakeWorkers.
+    template<class RunTask, class HasTask>
+    bool waitForRound(uint32_t& lastGeneration, RunTask runTask, HasTask hasTask){
+        auto roundReady = [this, &lastGeneration]{
+            return m_generation.load(std::memory_order_acquire) != lastGeneration ||
+                   !m_running.load(std::memory_order_acquire);
+        };
+        while(!roundReady()){
+            if(runTask()){
+                continue;
+            }
+            m_wait.wait(m_start, [&]{ return roundReady() || hasTask(); });
+        }
+        lastGeneration = m_generation.load(std::memory_order_acquire);
+        return m_running.load(std::memory_order_acquire);
+    }
+    void wakeWorkers(){
+        m_start.notifyAll();
+    }
+    void finishRound(bool& localSense){
+        m_done.arrive(localSense);
+    }
+    void stop(){
+        m_running.store(false, std::memory_order_release);
+        m_start.notifyAll();
+    }
+    uint32_t generation() const{
+        return m_generation.load(std::memory_order_acquire);
+    }
+    /// Starting localSense for a worker added now: the barrier has already flipped once per round
+    bool sense() const{
+        return m_done.sense();
+    }
+private:
+    WaitStrategy m_wait;
+    alignas(64) std::atomic<uint32_t> m_generation{0};
+    std::atomic<bool> m_running{true};
+    EventCount m_start;
+    SenseBarrier m_done;
+    bool m_master_sense = false;
+    int m_workers = 0;
+};
+
 class ThreadPool {
 public:
-    explicit ThreadPool() : running(true){}
+    using Job = std::function<void(int)>;
+
+    explicit ThreadPool(WaitStrategy wait = WaitStrategy{}) : dispatcher(wait){}
 
     void registerModule(Module* module){
-        threads.emplace_back(&ThreadPool::threadProcess, this, module, count);
-        signals.emplace_back(false);
+        registerJob([module](int threadIndex){ module->Run(threadIndex); });
+    }
+
+    void registerJob(Job job){
+        dispatcher.addWorker();
+        threads.emplace_back(&ThreadPool::threadProcess, this, std::move(job), count, dispatcher.generation(),
+                             dispatcher.sense());
         count++;
+        if(latency){
+            latency->resize(count);
+        }
+    }
+
+    // Only between runs; turning it on again keeps the recorded values
+    void setLatencyStats(bool enable){
+        if(enable && !latency){
+            latency.reset(new PoolLatency(count));
+        }
+        recordLatency = enable;
+    }
+    const PoolLatency* latencyStats() const{
+        return latency.get();
     }
 
     void run() {
-        // initiate threads
-        for(auto& state: signals){
-            state.store(true, std::memory_order_release);
+        if(!recordLatency){
+            dispatcher.runRound();
+            return;
         }
-        barrier();
+        latency->roundStarted();
+        dispatcher.runRound();
+        latency->roundFinished();
     }
 
     ~ThreadPool() {
-        running = false;
-        barrier();
+        dispatcher.stop();
         for (std::thread& thread : threads) {
             thread.join(); // Wait for all threads to exit
         }
     }
 
 private:
-    void barrier(){
-        // Sets a barrier here to sync all threads
-        std::unique_lock<std::mutex>lk(mutex);
-        cv.wait(lk, [this]{
-            return !std::any_of(signals.begin(),
-                               signals.end(),
-                               [](std::atomic<bool> &m_state){return m_state.load(std::memory_order_acquire);});
-        });
-    }
-
-    void threadProcess(Module* module, int threadIndex) {
-        while(true) {
-            if (!running) {
-                return;
+    void threadProcess(Job job, int threadIndex, uint32_t generation, bool sense) {
+        while(dispatcher.waitForRound(generation)) {
+            if(recordLatency){
+                uint64_t start = latency->workerStarted(threadIndex);
+                job(threadIndex);
+                latency->workerFinished(threadIndex, latency->jobFinished(threadIndex, start));
             }
-            if(signals[threadIndex].load(std::memory_order_acquire)){
-                module->Run(threadIndex);
-                signals[threadIndex].store(false, std::memory_order_release);
-                cv.notify_all();
+            else{
+                job(threadIndex);
             }
+            dispatcher.finishRound(sense);
         }
     }
 
 private:
     std::vector<std::thread> threads;
-    std::deque<std::atomic<bool>> signals;
-    std::atomic<bool> running{true};
-    std::condition_variable cv;
-    std::mutex mutex;
+    RoundDispatcher dispatcher;
+    std::unique_ptr<PoolLatency> latency;
+    bool recordLatency = false;
     int count = 0;
 };
 
+/// Bounded exponential backoff for lock waiters: doubling runs of cpuRelax, then yields, then
+/// (if allowed) sleeps doubling up to about a millisecond. Spinning is skipped on a single core,
+/// where it only delays the lock holder.
+class Backoff{
+public:
+    explicit Backoff(bool allowSleep = true) : m_allow_sleep(allowSleep){}
+
+    void pause(){
+        // hardware_concurrency is a system call, not something to repeat on every step
+        static const bool multiCore = std::thread::hardware_concurrency() > 1;
+        if(m_step < kSpinSteps && multiCore){
+            for(int i = 0; i < (1 << m_step); i++){
+                cpuRelax();
+            }
+        }
+        else if(m_step < kSpinSteps + kYieldSteps || !m_allow_sleep){
+            std::this_thread::yield();
+        }
+        else{
+            int shift = std::min(m_step - kSpinSteps - kYieldSteps, kMaxSleepShift);
+            std::this_thread::sleep_for(std::chrono::microseconds(1 << shift));
+        }
+        if(m_step < kSpinSteps + kYieldSteps + kMaxSleepShift){
+            m_step++;
+        }
+    }
+    void reset(){
+        m_step = 0;
+    }
+
+private:
+    static constexpr int kSpinSteps = 8;
+    static constexpr int kYieldSteps = 50;
+    static constexpr int kMaxSleepShift = 10;
+    int m_step = 0;
+    bool m_allow_sleep;
+};
+
+/// Optional contention counters for one SpinLock or McsLock. Only updated by the thread that just
+/// got the lock, so they are plain loads and stores and must not be shared between locks; wait
+/// time is only measured when the lock was contended. The exception is busy, a try_lock that found
+/// the lock taken: it neither waited nor acquired and races the holder, so it counts with an RMW.
+struct LockStats {
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> waitNanos{0};
+    std::atomic<uint64_t> busy{0};
+
+    void record(bool wasContended, std::chrono::steady_clock::time_point waitStart){
+        acquisitions.store(acquisitions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if(wasContended){
+            auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - waitStart).count();
+            contended.store(contended.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            waitNanos.store(waitNanos.load(std::memory_order_relaxed) + waited, std::memory_order_relaxed);
+        }
+    }
+    /// A try_lock that found the lock taken
+    void recordBusy(){
+        busy.fetch_add(1, std::memory_order_relaxed);
+    }
+    void reset(){
+        acquisitions = 0;
+        contended = 0;
+        waitNanos = 0;
+        busy = 0;
+    }
+    void report(std::ostream& out, const std::string& name) const{
+        uint64_t total = acquisitions.load(std::memory_order_relaxed);
+        uint64_t slow = contended.load(std::memory_order_relaxed);
+        uint64_t waited = waitNanos.load(std::memory_order_relaxed);
+        out << name << ": " << total << " acquisitions, " << slow << " contended, "
+            << waited / 1000 << " us waited, " << (slow ? waited / slow : 0) << " ns per contended, "
+            << busy.load(std::memory_order_relaxed) << " try_lock busy\n";
+    }
+};
+
+/// Test and test-and-set lock, all waiters spin on the same line. Fine when uncontended, see
+/// McsLock otherwise.
 struct SpinLock {
-    int retries{0};
     std::atomic<bool> lock_ = {false};
+    LockStats* stats = nullptr;
+
     void lock() {
+        if (!lock_.exchange(true, std::memory_order_acquire)) {
+            if (stats) {
+                stats->record(false, {});
+            }
+            return;
+        }
+        auto waitStart = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+        Backoff backoff;
         for (;;) {
-            retries = 0;
+            while (lock_.load(std::memory_order_relaxed)) {
+                backoff.pause();
+            }
             if (!lock_.exchange(true, std::memory_order_acquire)) {
                 break;
             }
-            while (lock_.load(std::memory_order_relaxed)) {
-                //std::this_thread::yield();
-                backoff();
-            }
+        }
+        if (stats) {
+            stats->record(true, waitStart);
         }
     }
-    void backoff() const {
-        const int max_retries = 50;
-        if (retries < max_retries) {
-            std::this_thread::yield();
-        } else {
-            auto delay = std::chrono::microseconds(1 << (retries - max_retries));
-            std::this_thread::sleep_for(delay);
+    bool try_lock() {
+        bool acquired = !lock_.load(std::memory_order_relaxed) && !lock_.exchange(true, std::memory_order_acquire);
+        if (stats) {
+            if (acquired) {
+                stats->record(false, {});
+            }
+            else {
+                stats->recordBusy();
+            }
         }
+        return acquired;
     }
 
     void unlock() { lock_.store(false, std::memory_order_release); }
 };
 
+/// MCS queue lock: waiters line up in a linked list of per-thread nodes and each spins on its
+/// own node, so a release touches one waiter's cache line and the lock is handed over in FIFO
+/// order. Nodes come from a small per-thread pool, so a thread can hold up to kMaxHeld MCS locks
+/// at once in any unlock order. Waiters back off but never sleep, the next owner is always awake
+/// soon after the handover. With more threads than cores every handover waits for the next
+/// waiter to be scheduled, SpinLock is the better choice there.
+class McsLock {
+public:
+    static constexpr int kMaxHeld = 16;
+
+    explicit McsLock(LockStats* stats = nullptr) : m_stats(stats){}
+    McsLock(const McsLock&) = delete;
+    McsLock& operator=(const McsLock&) = delete;
+
+    void lock(){
+        Node* node = acquireNode();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->locked.store(true, std::memory_order_relaxed);
+        Node* previous = m_tail.exchange(node, std::memory_order_acq_rel);
+        if(previous){
+            auto waitStart = m_stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+            previous->next.store(node, std::memory_order_release);
+            Backoff backoff(false);
+            while(node->locked.load(std::memory_order_acquire)){
+                backoff.pause();
+            }
+            if(m_stats){
+                m_stats->record(true, waitStart);
+            }
+        }
+        else if(m_stats){
+            m_stats->record(false, {});
+        }
+        m_owner = node;
+    }
+    bool try_lock(){
+        Node* node = acquireNode();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* expected = nullptr;
+        if(!m_tail.compare_exchange_strong(expected, node, std::memory_order_acq_rel, std::memory_order_relaxed)){
+            releaseNode(node);
+            if(m_stats){
+                m_stats->recordBusy();
+            }
+            return false;
+        }
+        if(m_stats){
+            m_stats->record(false, {});
+        }
+        m_owner = node;
+        return true;
+    }
+    void unlock(){
+        Node* node = m_owner;
+        Node* next = node->next.load(std::memory_order_acquire);
+        if(!next){
+            Node* expected = node;
+            if(m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel, std::memory_order_relaxed)){
+                releaseNode(node);
+                return;
+            }
+            // A waiter swapped itself in but has not linked up yet
+            Backoff backoff(false);
+            while(!(next = node->next.load(std::memory_order_acquire))){
+                backoff.pause();
+            }
+        }
+        next->locked.store(false, std::memory_order_release);
+        releaseNode(node);
+    }
+
+private:
+    struct alignas(64) Node{
+        std::atomic<Node*> next{nullptr};
+        std::atomic<bool> locked{false};
+        int index = 0;
+    };
+    struct NodePool{
+        Node nodes[kMaxHeld];
+        uint32_t used = 0;
+        NodePool(){
+            for(int i = 0; i < kMaxHeld; i++){
+                nodes[i].index = i;
+            }
+        }
+    };
+
+    static NodePool& pool(){
+        thread_local NodePool nodes;
+        return nodes;
+    }
+    static Node* acquireNode(){
+        NodePool& nodes = pool();
+        assert(nodes.used != (1u << kMaxHeld) - 1 && "too many McsLocks held by one thread");
+        int index = __builtin_ctz(~nodes.used);
+        nodes.used |= 1u << index;
+        return &nodes.nodes[index];
+    }
+    static void releaseNode(Node* node){
+        pool().used &= ~(1u << node->index);
+    }
+
+    alignas(64) std::atomic<Node*> m_tail{nullptr};
+    Node* m_owner = nullptr; // only touched by the holder
+    LockStats* m_stats;
+};
+
+/// One thread per registered job, all of them invoked once per run(). Between rounds the same
+/// workers run tasks handed in with submit, post and parallel_for, so statistics, dumps or
+/// checkpoint writing do not need threads of their own. Tasks should be short: a worker starts
+/// its next round only after the task it is running.
 class ThreadPoolOp {
 public:
-    explicit ThreadPoolOp() : running(true){}
+    using Job = std::function<void(int)>;
+
+    explicit ThreadPoolOp(WaitStrategy wait = WaitStrategy{}, PlacementPolicy placement = PlacementPolicy{},
+                          size_t taskCapacity = 4096)
+        : dispatcher(wait), placement(std::move(placement)), tasks(taskCapacity, wait), waitStrategy(wait){}
 
     void registerModule(Module* module){
-        signals.emplace_back(0);
-        threads.emplace_back(&ThreadPoolOp::threadProcess, this, module, count);
+        registerJob([module](int threadIndex){ module->Run(threadIndex); });
+    }
+
+    // Every job gets its own thread and is invoked once per run().
+    // init runs once on the worker after it is pinned, so state it allocates is first touched on
+    // the worker's NUMA node.
+    void registerJob(Job job, Job init = nullptr){
+        dispatcher.addWorker();
+        threads.emplace_back(&ThreadPoolOp::threadProcess, this, std::move(job), std::move(init), count,
+                             dispatcher.generation(), dispatcher.sense());
         count++;
+        if(latency){
+            latency->resize(count);
+        }
+    }
+
+    // Only between runs; turning it on again keeps the recorded values
+    void setLatencyStats(bool enable){
+        if(enable && !latency){
+            latency.reset(new PoolLatency(count));
+        }
+        recordLatency = enable;
+    }
+    const PoolLatency* latencyStats() const{
+        return latency.get();
+    }
+
+    // CPU the given worker is pinned to, -1 if none
+    int workerCpu(int threadIndex) const{
+        return placement.cpuFor(threadIndex);
+    }
+
+    // NUMA node to allocate the given worker's state on, e.g. with NodeAllocator
+    int workerNode(int threadIndex) const{
+        int cpu = workerCpu(threadIndex);
+        return cpu < 0 ? 0 : Topology::get().nodeOf(cpu);
     }
 
     void run() {
-        // initiate threads
-        assert(sum.load() == 0);
-        sum.store(count, std::memory_order_release);
+        if(!recordLatency){
+            dispatcher.runRound();
+            return;
+        }
+        latency->roundStarted();
+        dispatcher.runRound();
+        latency->roundFinished();
+    }
 
-        std::unique_lock<std::mutex>lk2(mutex);
-        std::fill(signals.begin(), signals.begin()+count, 1);
-        flag = true;
-        cv.notify_all();
+    // Runs f on a worker and returns its result or exception through the future. With no workers,
+    // or with the task queue full, f runs right here instead.
+    template<class F>
+    auto submit(F f) -> std::future<decltype(f())> {
+        std::packaged_task<decltype(f())()> task(std::move(f));
+        auto result = task.get_future();
+        post(std::move(task));
+        return result;
+    }
 
-        while(flag){
-            cv.wait(lk2);
+    // Like submit without a future, exceptions thrown by f are dropped
+    template<class F>
+    void post(F f) {
+        Task task(std::move(f));
+        if(count == 0 || !tasks.try_push(task)){
+            task();
+            return;
+        }
+        dispatcher.wakeWorkers();
+    }
+
+    // Calls f(chunkBegin, chunkEnd) over [begin, end) in chunks of about grain, on the workers and
+    // the calling thread, and returns when all chunks are done. Rethrows the first exception.
+    template<class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F f) {
+        if(begin >= end){
+            return;
+        }
+        grain = std::max<size_t>(grain, 1);
+        auto state = std::make_shared<ForState>();
+        state->begin = begin;
+        state->end = end;
+        state->grain = grain;
+        size_t chunks = (end - begin + grain - 1) / grain;
+        state->remaining.store(chunks, std::memory_order_relaxed);
+        state->body = [&f](size_t chunkBegin, size_t chunkEnd){ f(chunkBegin, chunkEnd); };
+        size_t helpers = std::min<size_t>(static_cast<size_t>(count), chunks - 1);
+        for(size_t i = 0; i < helpers; i++){
+            post([state]{ state->work(); });
+        }
+        state->work();
+        waitStrategy.wait(state->done, [&state]{ return state->remaining.load(std::memory_order_acquire) == 0; });
+        if(state->error){
+            std::rethrow_exception(state->error);
         }
-        //std::cout << "=================" << std::endl;
     }
 
     ~ThreadPoolOp() {
-        running = false;
-        std::fill(signals.begin(), signals.begin()+count, 1);
-        cv.notify_all();
+        Task task;
+        while(tasks.try_pop(task)){
+            task();
+        }
+        dispatcher.stop();
         for (std::thread& thread : threads) {
             thread.join(); // Wait for all threads to exit
         }
     }
 
 private:
-    void threadProcess(Module* module, int threadIndex) {
-        while(true) {
-            std::unique_lock<std::mutex> lk2(mutex);
-            while(!signals[threadIndex]){
-                cv.wait(lk2);
+    void threadProcess(Job job, Job init, int threadIndex, uint32_t generation, bool sense) {
+        pinCurrentThread(placement.cpuFor(threadIndex));
+        if(init){
+            init(threadIndex);
+        }
+        auto runTask = [this]{
+            Task task;
+            if(!tasks.try_pop(task)){
+                return false;
             }
-            signals[threadIndex] = false;
-            lk2.unlock();
-
-            if (!running) {
-                return;
+            task();
+            return true;
+        };
+        auto hasTask = [this]{ return !tasks.empty(); };
+        while(dispatcher.waitForRound(generation, runTask, hasTask)) {
+            if(recordLatency){
+                uint64_t start = latency->workerStarted(threadIndex);
+                job(threadIndex);
+                latency->workerFinished(threadIndex, latency->jobFinished(threadIndex, start));
+            }
+            else{
+                job(threadIndex);
             }
+            dispatcher.finishRound(sense);
+        }
+    }
+
+    using Task = std::packaged_task<void()>;
+
+    /// Shared by the caller and the helper tasks of one parallel_for, helpers that only start
+    /// after the last chunk find nothing to do and never touch the body
+    struct ForState {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> remaining{0};
+        size_t begin = 0;
+        size_t end = 0;
+        size_t grain = 1;
+        std::function<void(size_t, size_t)> body;
+        EventCount done;
+        std::mutex errorMutex;
+        std::exception_ptr error;
 
-            module->Run(threadIndex);
-            int before = sum.fetch_sub(1, std::memory_order_release);
-            if (before == 1) {
-                {
-                    lk2.lock();
-                    flag = false;
-                    cv.notify_all();
+        void work(){
+            while(true){
+                size_t chunk = next.fetch_add(1, std::memory_order_relaxed);
+                size_t chunkBegin = begin + chunk * grain;
+                if(chunkBegin >= end){
+                    return;
+                }
+                try{
+                    body(chunkBegin, std::min(end, chunkBegin + grain));
+                }
+                catch(...){
+                    std::lock_guard<std::mutex> lg(errorMutex);
+                    if(!error){
+                        error = std::current_exception();
+                    }
+                }
+                if(remaining.fetch_sub(1, std::memory_order_acq_rel) == 1){
+                    done.notifyAll();
                 }
             }
         }
-    }
+    };
 
 private:
     std::vector<std::thread> threads;
-    std::vector<int> signals; // 0 --> pause, 1 --> start
-    std::atomic<bool> running{true};
-    SpinLock lk;
+    RoundDispatcher dispatcher;
+    PlacementPolicy placement;
+    std::unique_ptr<PoolLatency> latency;
+    bool recordLatency = false;
+    LockFreeQueue<Task> tasks;
+    WaitStrategy waitStrategy;
     int count = 0;
-    std::atomic<int> sum{0};
-    std::condition_variable cv;
-    std::mutex mutex;
-    bool flag = false;
+};
+
+/// Fixed number of threads running any number of registered jobs once per run(). Each worker owns
+/// a contiguous slice of the job order: it takes jobs from the front of its own slice and, once
+/// that is empty, steals from the back of the other slices, so a slow job only delays the jobs
+/// behind it until somebody steals them. The thread calling run() works as worker 0.
+/// With cost awareness on, jobs are dealt longest first (by a moving average of their recent run
+/// time) to the least loaded worker, so long jobs start first.
+/// Workers 1..numThreads-1 are pinned by the placement policy, the calling thread is left alone.
+class WorkStealingPool {
+public:
+    using Job = std::function<void(int)>;
+
+    explicit WorkStealingPool(int numThreads, WaitStrategy wait = WaitStrategy{},
+                              PlacementPolicy placement = PlacementPolicy{})
+        : numWorkers(numThreads > 0 ? numThreads : 1)
+        , slices(new Slice[numWorkers])
+        , dispatcher(wait)
+        , placement(std::move(placement)){
+        for(int i = 1; i < numWorkers; i++){
+            dispatcher.addWorker();
+            threads.emplace_back(&WorkStealingPool::threadProcess, this, i, dispatcher.generation(), dispatcher.sense());
+        }
+    }
+
+    void registerModule(Module* module){
+        registerJob([module](int threadIndex){ module->Run(threadIndex); });
+    }
+
+    // Only between runs
+    void registerJob(Job job){
+        jobs.push_back(std::move(job));
+        costs.push_back(0);
+        order.push_back(static_cast<uint32_t>(order.size()));
+        dealt = false;
+    }
+
+    void setCostAware(bool enable){
+        costAware = enable;
+        dealt = false;
+    }
+
+    // Only between runs; turning it on again keeps the recorded values. Run times are per job,
+    // dispatch and barrier per worker with the caller as worker 0.
+    void setLatencyStats(bool enable){
+        if(enable && !latency){
+            latency.reset(new PoolLatency(numWorkers));
+        }
+        recordLatency = enable;
+    }
+    const PoolLatency* latencyStats() const{
+        return latency.get();
+    }
+
+    void run() {
+        if(costAware || !dealt){
+            deal();
+        }
+        else{
+            for(int i = 0; i < numWorkers; i++){
+                slices[i].bounds.store(slices[i].initial, std::memory_order_relaxed);
+            }
+        }
+        if(recordLatency){
+            latency->roundStarted();
+        }
+        dispatcher.startRound();
+        work(0);
+        dispatcher.waitRound();
+        if(recordLatency){
+            latency->roundFinished();
+        }
+    }
+
+    ~WorkStealingPool() {
+        dispatcher.stop();
+        for (std::thread& thread : threads) {
+            thread.join(); // Wait for all threads to exit
+        }
+    }
+
+private:
+    struct alignas(64) Slice {
+        std::atomic<uint64_t> bounds{0}; // head in the low half, tail in the high half
+        uint64_t initial = 0;
+    };
+
+    static uint64_t pack(uint32_t head, uint32_t tail){
+        return static_cast<uint64_t>(tail) << 32 | head;
+    }
+
+    /// Splits the job order into one slice per worker
+    void deal(){
+        std::vector<uint32_t> owner(jobs.size());
+        std::vector<uint32_t> counts(numWorkers, 0);
+        if(costAware){
+            std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b){ return costs[a] > costs[b]; });
+            // Longest job first to the least loaded worker
+            std::vector<uint64_t> load(numWorkers, 0);
+            for(uint32_t job: order){
+                auto worker = static_cast<uint32_t>(std::min_element(load.begin(), load.end()) - load.begin());
+                load[worker] += costs[job] + 1;
+                owner[job] = worker;
+                counts[worker]++;
+            }
+            std::stable_sort(order.begin(), order.end(), [&owner](uint32_t a, uint32_t b){ return owner[a] < owner[b]; });
+        }
+        else{
+            for(size_t i = 0; i < order.size(); i++){
+                counts[i * numWorkers / order.size()]++;
+            }
+        }
+        uint32_t head = 0;
+        for(int i = 0; i < numWorkers; i++){
+            slices[i].initial = pack(head, head + counts[i]);
+            slices[i].bounds.store(slices[i].initial, std::memory_order_relaxed);
+            head += counts[i];
+        }
+        dealt = true;
+    }
+
+    bool take(int worker, bool front, uint32_t& job){
+        auto& bounds = slices[worker].bounds;
+        uint64_t current = bounds.load(std::memory_order_acquire);
+        while(true){
+            auto head = static_cast<uint32_t>(current);
+            auto tail = static_cast<uint32_t>(current >> 32);
+            if(head >= tail){
+                return false;
+            }
+            uint64_t next = front ? pack(head + 1, tail) : pack(head, tail - 1);
+            if(bounds.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_acquire)){
+                job = order[front ? head : tail - 1];
+                return true;
+            }
+        }
+    }
+
+    /// stamp is the end of the previous job (or the start of the round) when latency is recorded
+    void runJob(uint32_t job, int worker, uint64_t& stamp){
+        if(recordLatency){
+            uint64_t start = stamp;
+            jobs[job](worker);
+            stamp = latency->jobFinished(worker, start);
+            if(costAware){
+                costs[job] = costs[job] == 0 ? stamp - start : (costs[job] * 3 + stamp - start) / 4;
+            }
+            return;
+        }
+        if(!costAware){
+            jobs[job](worker);
+            return;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        jobs[job](worker);
+        auto t2 = std::chrono::steady_clock::now();
+        auto cost = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count());
+        costs[job] = costs[job] == 0 ? cost : (costs[job] * 3 + cost) / 4;
+    }
+
+    void work(int worker){
+        uint64_t stamp = recordLatency ? latency->workerStarted(worker) : 0;
+        uint32_t job = 0;
+        while(take(worker, true, job)){
+            runJob(job, worker, stamp);
+        }
+        for(int i = 1; i < numWorkers; i++){
+            int victim = (worker + i) % numWorkers;
+            while(take(victim, false, job)){
+                runJob(job, worker, stamp);
+            }
+        }
+        if(recordLatency){
+            latency->workerFinished(worker, stamp);
+        }
+    }
+
+    void threadProcess(int worker, uint32_t generation, bool sense) {
+        pinCurrentThread(placement.cpuFor(worker));
+        while(dispatcher.waitForRound(generation)) {
+            work(worker);
+            dispatcher.finishRound(sense);
+        }
+    }
+
+private:
+    int numWorkers;
+    std::vector<Job> jobs;
+    std::vector<uint64_t> costs; // nanoseconds, written by the worker that ran the job
+    std::vector<uint32_t> order;
+    std::unique_ptr<Slice[]> slices;
+    bool costAware = false;
+    bool dealt = false;
+    std::unique_ptr<PoolLatency> latency;
+    bool recordLatency = false;
+    RoundDispatcher dispatcher;
+    PlacementPolicy placement;
+    std::vector<std::thread> threads;
 };
 
 #endif //OPENMP_PARALLELLIB_H
@@ -0,0 +1,153 @@
+//
+// Created by Han on 2024/3/30.
+//
+
+#ifndef OPENMP_PARTITION_H
+#define OPENMP_PARTITION_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Factory.h"
+
+/// Conservative parallel simulation: the module graph is split into partitions, each stepping
+/// its own cycle on its own thread. Connects between partitions are split (see Connect::Split)
+/// and carried over a Fifo4. Their latency is the lookahead: an entry written by the upper
+/// partition in cycle u is only read in cycle u + latency, so the down partition may commit
+/// cycle c as soon as the upper partition has sent everything up to cycle c + 1 - latency.
+/// There is no global barrier, partitions only wait on the progress of the ones feeding them.
+///
+/// Every partition cycle runs the evaluate and commit phases of CycleEngine in order, so the
+/// results match a single threaded run.
+class PartitionedSimulation{
+public:
+    explicit PartitionedSimulation(int numPartitions, size_t ringCapacity = 1024)
+        : m_ring_capacity(ringCapacity){
+        for(int i = 0; i < numPartitions; i++){
+            m_partitions.emplace_back();
+        }
+    }
+
+    template<class T>
+    void registerModule(int partition, T* module){
+        m_partition_of[module] = partition;
+        m_partitions[partition].modules.emplace_back([module](uint64_t cycle){ module->PollOneCycle(cycle); });
+    }
+
+    /// Both modules have to be registered first, a connect crossing partitions is split
+    template<class T>
+    void registerConnect(T* connect){
+        int upper = m_partition_of.at(connect->GetUpperModule());
+        int down = m_partition_of.at(connect->GetDownModule());
+        if(upper == down){
+            m_partitions[upper].connects.emplace_back([connect](uint64_t cycle){
+                if(connect->HasWork()){
+                    connect->CatchUp(cycle);
+                    connect->RunOneCycle();
+                }
+            });
+            return;
+        }
+        connect->Split(m_ring_capacity);
+        Partition* partition = &m_partitions[upper];
+        m_partitions[upper].outgoing.emplace_back([this, partition, connect](uint64_t cycle){
+            connect->CommitRemote(cycle, [this, partition]{
+                drainIncoming(*partition);
+                std::this_thread::yield();
+            });
+        });
+        m_partitions[down].incoming.push_back(Incoming{
+            [connect]{ connect->DrainRemote(); },
+            [connect](uint64_t cycle){ connect->DeliverRemote(cycle); },
+            upper,
+            connect->GetLatency()});
+    }
+
+    /// Runs every partition for the given number of cycles on its own thread
+    void run(uint64_t cycles){
+        std::vector<std::thread> threads;
+        for(size_t i = 0; i < m_partitions.size(); i++){
+            threads.emplace_back(&PartitionedSimulation::partitionProcess, this, i, cycles);
+        }
+        for(auto& thread: threads){
+            thread.join();
+        }
+    }
+
+    uint64_t GetCycle(int partition) const{
+        return m_partitions[partition].cycle;
+    }
+
+private:
+    struct Incoming{
+        std::function<void()> drain;
+        std::function<void(uint64_t)> deliver;
+        int upper;
+        uint32_t latency;
+    };
+
+    struct Partition{
+        std::vector<std::function<void(uint64_t)>> modules;
+        std::vector<std::function<void(uint64_t)>> connects; // both ends in this partition
+        std::vector<std::function<void(uint64_t)>> outgoing;
+        std::vector<Incoming> incoming;
+        uint64_t cycle = 0; // only touched by the partition thread
+        /// Number of cycles whose outgoing entries have all been pushed
+        alignas(64) std::atomic<uint64_t> sent{0};
+    };
+
+    /// Empties the rings of every link into partition, their entries wait in the inboxes
+    static void drainIncoming(Partition& partition){
+        for(auto& link: partition.incoming){
+            link.drain();
+        }
+    }
+
+    void partitionProcess(size_t index, uint64_t cycles){
+        Partition& partition = m_partitions[index];
+        uint64_t end = partition.cycle + cycles;
+        for(uint64_t& cycle = partition.cycle; cycle < end; cycle++){
+            // evaluate
+            for(auto& module: partition.modules){
+                module(cycle);
+            }
+            // commit, publish our own sends first so partitions feeding each other cannot deadlock
+            for(auto& connect: partition.outgoing){
+                connect(cycle);
+            }
+            partition.sent.store(cycle + 1, std::memory_order_release);
+            for(auto& connect: partition.connects){
+                connect(cycle);
+            }
+            for(auto& link: partition.incoming){
+                // Entries delivered by cycle + 1 were written up to cycle + 1 - latency
+                uint64_t needed = cycle + 2 > link.latency ? cycle + 2 - link.latency : 0;
+                while(m_partitions[link.upper].sent.load(std::memory_order_acquire) < needed){
+                    // The upper partition may be stuck on a full ring of any link into this one
+                    drainIncoming(partition);
+                    std::this_thread::yield();
+                }
+                link.drain();
+                link.deliver(cycle);
+            }
+        }
+        // The last bursts of the partitions feeding this one may not fit their rings, keep
+        // draining until they are done too. The entries wait in the inboxes for the next run.
+        for(auto& link: partition.incoming){
+            while(m_partitions[link.upper].sent.load(std::memory_order_acquire) < end){
+                drainIncoming(partition);
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    size_t m_ring_capacity;
+    std::deque<Partition> m_partitions; // atomics, never moved
+    std::unordered_map<const void*, int> m_partition_of;
+};
+
+#endif //OPENMP_PARTITION_H
@@ -0,0 +1,122 @@
+//
+// Created by Han on 2024/6/8.
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "Partition.h"
+
+/// Partitions that block each other on full rings: Source writes a burst larger than the ring on
+/// two links into Sink every cycle and Sink answers with a burst on a link back. Both sides fold
+/// what they read into a hash, which must match a single threaded run of the same graph. A
+/// deadlock shows up as a hang.
+
+struct Source;
+struct Sink;
+struct Left{ uint64_t value; };
+struct Right{ uint64_t value; };
+struct Back{ uint64_t value; };
+using LeftConnect = Connect<Left, Source, Sink>;
+using RightConnect = Connect<Right, Source, Sink>;
+using BackConnect = Connect<Back, Sink, Source>;
+
+constexpr int kBurst = 10;
+constexpr size_t kRingCapacity = 8;
+
+struct Source : FactoryBase<Source>{
+    void RunOneCycle(){
+        Back back{};
+        while(m_back->Read(back)){
+            hash = hash * 31 + back.value + cycle_count;
+        }
+        for(int i = 0; i < kBurst; i++){
+            m_left->Write(Left{hash + i});
+            m_right->Write(Right{cycle_count * kBurst + i});
+        }
+    }
+    std::string GetModuleID(){
+        return "Source";
+    }
+    void Bind(LeftConnect* connect){
+        m_left = connect;
+    }
+    void Bind(RightConnect* connect){
+        m_right = connect;
+    }
+    void Bind(BackConnect* connect){
+        m_back = connect;
+    }
+    uint64_t hash = 0;
+private:
+    LeftConnect* m_left = nullptr;
+    RightConnect* m_right = nullptr;
+    BackConnect* m_back = nullptr;
+};
+
+struct Sink : FactoryBase<Sink>{
+    void RunOneCycle(){
+        Left left{};
+        while(m_left->Read(left)){
+            hash = hash * 17 + left.value + cycle_count;
+        }
+        Right right{};
+        while(m_right->Read(right)){
+            hash = hash * 13 + right.value;
+        }
+        for(int i = 0; i < kBurst; i++){
+            m_back->Write(Back{hash + i});
+        }
+    }
+    std::string GetModuleID(){
+        return "Sink";
+    }
+    void Bind(LeftConnect* connect){
+        m_left = connect;
+    }
+    void Bind(RightConnect* connect){
+        m_right = connect;
+    }
+    void Bind(BackConnect* connect){
+        m_back = connect;
+    }
+    uint64_t hash = 0;
+private:
+    LeftConnect* m_left = nullptr;
+    RightConnect* m_right = nullptr;
+    BackConnect* m_back = nullptr;
+};
+
+using Graph = ModuleGraph<ModuleList<Source, Sink>, ConnectList<LeftConnect, RightConnect, BackConnect>>;
+
+void setLatencies(Graph& graph){
+    graph.Get<LeftConnect>().SetLatency(2);
+    graph.Get<RightConnect>().SetLatency(3);
+    graph.Get<BackConnect>().SetLatency(1);
+}
+
+/// usage: PartitionStress [cycles]
+int main(int argc, char* argv[]){
+    uint64_t cycles = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000;
+
+    Graph reference;
+    setLatencies(reference);
+    reference.Run(cycles);
+
+    Graph graph;
+    setLatencies(graph);
+    PartitionedSimulation simulation(2, kRingCapacity);
+    simulation.registerModule(0, &graph.Get<Source>());
+    simulation.registerModule(1, &graph.Get<Sink>());
+    simulation.registerConnect(&graph.Get<LeftConnect>());
+    simulation.registerConnect(&graph.Get<RightConnect>());
+    simulation.registerConnect(&graph.Get<BackConnect>());
+    simulation.run(cycles);
+
+    bool ok = graph.Get<Source>().hash == reference.Get<Source>().hash &&
+              graph.Get<Sink>().hash == reference.Get<Sink>().hash;
+    std::cout << "PartitionedSimulation links 3 burst " << kBurst << " ring " << kRingCapacity << " cycles " << cycles
+              << (ok ? " ok" : " FAILED") << "\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+//
+// Created by Han on 2024/4/20.
+//
+
+#include <omp.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ParallelLib.h"
+
+/// One cache line of state per module, stepped work times per round
+struct alignas(64) BenchState{
+    uint64_t value[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+};
+
+inline void stepModule(BenchState& state, int work){
+    for(int i = 0; i < work; i++){
+        for(auto& value: state.value){
+            value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+    }
+}
+
+/// Modules [begin, end) of a contiguous share of modules per thread
+inline void stepRange(std::vector<BenchState>& modules, size_t begin, size_t end, int work){
+    for(size_t i = begin; i < end; i++){
+        stepModule(modules[i], work);
+    }
+}
+
+struct Config{
+    int threads;
+    size_t modules;
+    int work;
+    int rounds;
+};
+
+/// Times every round of runRound into a histogram, after a tenth of the rounds as warm up
+LatencyHistogram timeRounds(const Config& config, const std::function<void()>& runRound){
+    for(int i = 0; i < config.rounds / 10; i++){
+        runRound();
+    }
+    LatencyHistogram rounds;
+    for(int i = 0; i < config.rounds; i++){
+        uint64_t t1 = PoolLatency::now();
+        runRound();
+        rounds.record(PoolLatency::now() - t1);
+    }
+    return rounds;
+}
+
+template<class Pool>
+LatencyHistogram benchPool(const Config& config, std::vector<BenchState>& modules, Pool& pool, bool detail,
+                           const std::string& name){
+    for(int t = 0; t < config.threads; t++){
+        size_t begin = modules.size() * t / config.threads;
+        size_t end = modules.size() * (t + 1) / config.threads;
+        int work = config.work;
+        pool.registerJob([&modules, begin, end, work](int){ stepRange(modules, begin, end, work); });
+    }
+    pool.setLatencyStats(detail);
+    LatencyHistogram rounds = timeRounds(config, [&pool]{ pool.run(); });
+    if(detail){
+        pool.latencyStats()->report(std::cout, name + " threads " + std::to_string(config.threads) +
+                                               " modules " + std::to_string(config.modules) +
+                                               " work " + std::to_string(config.work));
+    }
+    return rounds;
+}
+
+LatencyHistogram benchOpenMP(const Config& config, std::vector<BenchState>& modules){
+    omp_set_num_threads(config.threads);
+    auto count = static_cast<long>(modules.size());
+    int work = config.work;
+    return timeRounds(config, [&modules, count, work]{
+        #pragma omp parallel for schedule(static)
+        for(long i = 0; i < count; i++){
+            stepModule(modules[i], work);
+        }
+    });
+}
+
+void printRow(const std::string& pool, const Config& config, const LatencyHistogram& rounds){
+    std::cout << pool << "," << config.threads << "," << config.modules << "," << config.work << ","
+              << rounds.count() << "," << static_cast<uint64_t>(rounds.mean()) << ","
+              << rounds.percentile(0.5) << "," << rounds.percentile(0.99) << ","
+              << rounds.percentile(0.999) << "," << rounds.max() << "\n";
+}
+
+/// usage: PoolBenchmark [maxThreads] [rounds] [--detail]
+/// Sweeps thread count (powers of two up to maxThreads), module count and work per module over
+/// ThreadPool, ThreadPoolOp and OpenMP, one CSV row of round latency in nanoseconds per
+/// configuration. Every pool thread steps a contiguous share of the modules, like OpenMP's static
+/// schedule. --detail adds the pools' own dispatch/run/barrier histograms.
+int main(int argc, char* argv[]){
+    int maxThreads = 8;
+    int rounds = 1000;
+    bool detail = false;
+    int positional = 0;
+    for(int i = 1; i < argc; i++){
+        if(std::strcmp(argv[i], "--detail") == 0){
+            detail = true;
+        }
+        else if(positional++ == 0){
+            maxThreads = std::atoi(argv[i]);
+        }
+        else{
+            rounds = std::atoi(argv[i]);
+        }
+    }
+
+    std::cout << "pool,threads,modules,work,rounds,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n";
+    for(int threads = 1; threads <= maxThreads; threads *= 2){
+        for(size_t moduleCount: {16, 256, 4096}){
+            for(int work: {0, 16, 256}){
+                Config config{threads, moduleCount, work, rounds};
+                std::vector<BenchState> modules(moduleCount);
+                {
+                    ThreadPool pool;
+                    printRow("ThreadPool", config, benchPool(config, modules, pool, detail, "ThreadPool"));
+                }
+                {
+                    ThreadPoolOp pool;
+                    printRow("ThreadPoolOp", config, benchPool(config, modules, pool, detail, "ThreadPoolOp"));
+                }
+                printRow("OpenMP", config, benchOpenMP(config, modules));
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+//
+// Created by Han on 2024/6/15.
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "ParallelLib.h"
+
+/// Workers registered between runs: register, run, register, run... on ThreadPool and
+/// ThreadPoolOp. A worker added after the barrier has flipped must start from its current sense,
+/// otherwise the last arrival never releases the master and the run hangs. Every job counts its
+/// calls, which must equal the number of runs since it was registered.
+
+template<class Pool>
+bool stress(const char* name, int workers, int runsPerWorker){
+    Pool pool;
+    std::vector<std::unique_ptr<std::atomic<int>>> calls;
+    std::vector<int> expected;
+    for(int w = 0; w < workers; w++){
+        calls.emplace_back(new std::atomic<int>{0});
+        expected.push_back(0);
+        std::atomic<int>* counter = calls.back().get();
+        pool.registerJob([counter](int){ counter->fetch_add(1, std::memory_order_relaxed); });
+        for(int r = 0; r < runsPerWorker; r++){
+            pool.run();
+            for(auto& count: expected){
+                count++;
+            }
+        }
+    }
+    for(int w = 0; w < workers; w++){
+        if(calls[w]->load() != expected[w]){
+            std::cout << name << " worker " << w << " ran " << calls[w]->load() << " times, expected "
+                      << expected[w] << "\n";
+            return false;
+        }
+    }
+    std::cout << name << " workers " << workers << " runs " << workers * runsPerWorker << " ok\n";
+    return true;
+}
+
+/// usage: PoolStress [workers] [runsPerWorker]
+int main(int argc, char* argv[]){
+    int workers = argc > 1 ? std::atoi(argv[1]) : 8;
+    int runs = argc > 2 ? std::atoi(argv[2]) : 25;
+
+    bool ok = stress<ThreadPool>("ThreadPool", workers, runs);
+    // an odd number of runs between registrations leaves the barrier flipped when the next one joins
+    ok = stress<ThreadPool>("ThreadPool", workers, 1) && ok;
+    ok = stress<ThreadPoolOp>("ThreadPoolOp", workers, runs) && ok;
+    ok = stress<ThreadPoolOp>("ThreadPoolOp", workers, 1) && ok;
+    return ok ? 0 : 1;
+}
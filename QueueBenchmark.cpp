@@ -0,0 +1,87 @@
+//
+// Created by Han on 2024/4/27.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ParallelLib.h"
+
+/// Moves items through the queue from producers to consumers, who stop at a -1 sentinel each.
+/// Returns the run time in seconds.
+template<class Queue>
+double transfer(Queue& queue, int producers, int consumers, long items){
+    std::atomic<long> sum{0};
+    std::vector<std::thread> threads;
+    auto t1 = std::chrono::steady_clock::now();
+    for(int p = 0; p < producers; p++){
+        long begin = items * p / producers;
+        long end = items * (p + 1) / producers;
+        threads.emplace_back([&queue, begin, end]{
+            for(long i = begin; i < end; i++){
+                queue.push_back(i);
+            }
+        });
+    }
+    for(int c = 0; c < consumers; c++){
+        threads.emplace_back([&queue, &sum]{
+            long local = 0;
+            long value = 0;
+            while(true){
+                queue.wait_and_pop(value);
+                if(value < 0){
+                    break;
+                }
+                local += value;
+            }
+            sum += local;
+        });
+    }
+    for(int p = 0; p < producers; p++){
+        threads[p].join();
+    }
+    for(int c = 0; c < consumers; c++){
+        queue.push_back(-1);
+    }
+    for(int c = 0; c < consumers; c++){
+        threads[producers + c].join();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    if(sum != items * (items - 1) / 2){
+        std::cerr << "lost items\n";
+        std::exit(1);
+    }
+    return std::chrono::duration<double>(t2 - t1).count();
+}
+
+void printRow(const std::string& queue, int threads, long items, double seconds){
+    std::cout << queue << "," << threads << "," << threads << "," << items << "," << seconds << ","
+              << items / seconds / 1e6 << "\n";
+}
+
+/// usage: QueueBenchmark [maxThreads] [items] [capacity]
+/// Sweeps 1..maxThreads producers and as many consumers (powers of two) over ThreadSafeQueue and
+/// LockFreeQueue, one CSV row per run.
+int main(int argc, char* argv[]){
+    int maxThreads = argc > 1 ? std::atoi(argv[1]) : 32;
+    long items = argc > 2 ? std::atol(argv[2]) : 1000000;
+    size_t capacity = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 4096;
+
+    std::cout << "queue,producers,consumers,items,seconds,mops\n";
+    for(int threads = 1; threads <= maxThreads; threads *= 2){
+        {
+            ThreadSafeQueue<long> queue;
+            printRow("ThreadSafeQueue", threads, items, transfer(queue, threads, threads, items));
+        }
+        {
+            LockFreeQueue<long> queue(capacity);
+            printRow("LockFreeQueue", threads, items, transfer(queue, threads, threads, items));
+        }
+    }
+    return 0;
+}
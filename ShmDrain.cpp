@@ -0,0 +1,54 @@
+//
+// Created by Han on 2024/5/18.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+#include "ShmFifo.h"
+
+/// usage: ShmDrain <ring> <output>
+/// Sidecar for a ShmFifo: appends every record to the output file until the producer closes the
+/// ring and it runs empty. Length prefixed rings keep a 4 byte length in front of each record,
+/// fixed size rings are written back to back. Polls every 100 us while the ring is empty.
+int main(int argc, char* argv[]){
+    if(argc < 3){
+        std::cerr << "usage: ShmDrain <ring> <output>\n";
+        return 1;
+    }
+    ShmFifo ring = ShmFifo::attach(argv[1]);
+    FILE* output = std::fopen(argv[2], "ab");
+    if(output == nullptr){
+        std::cerr << "Cannot open " << argv[2] << "\n";
+        return 1;
+    }
+    bool prefixed = ring.recordSize() == ShmFifo::kLengthPrefixed;
+    uint64_t records = 0;
+    while(true){
+        uint32_t size = 0;
+        const void* record = ring.peek(size);
+        if(record == nullptr){
+            // Checked before the last look at the ring, so nothing pushed before close is lost
+            bool closed = ring.closed();
+            if(ring.peek(size) != nullptr){
+                continue;
+            }
+            if(closed){
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        if(prefixed){
+            std::fwrite(&size, sizeof(size), 1, output);
+        }
+        std::fwrite(record, 1, size, output);
+        ring.release();
+        records++;
+    }
+    std::fclose(output);
+    std::cout << "drained " << records << " records\n";
+    return 0;
+}
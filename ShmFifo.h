@@ -0,0 +1,326 @@
+//
+// Created by Han on 2024/5/18.
+//
+
+#ifndef OPENMP_SHMFIFO_H
+#define OPENMP_SHMFIFO_H
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Single producer, single consumer byte ring in a shared file mapping, so a separate process can
+/// drain what the simulator writes (dumps, traces) and do the I/O on its own cores.
+/// Everything shared lives in the mapping and is addressed by offsets: the cursors are byte counts
+/// since the ring was created, so the two processes may map it at different addresses, and either
+/// side can attach, detach and attach again later, the data stays in the file until it is popped.
+/// Records are either all recordSize bytes, or length prefixed (recordSize 0) with 8 byte
+/// alignment and a wrap marker where a record does not fit before the end of the ring.
+class ShmFifo{
+public:
+    static constexpr uint32_t kLengthPrefixed = 0;
+
+    /// Creates or truncates the ring file at path
+    static ShmFifo create(const std::string& path, uint64_t capacity, uint32_t recordSize = kLengthPrefixed){
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            throw std::runtime_error("Cannot create ring " + path);
+        }
+        return ShmFifo(fd, capacity, recordSize, path);
+    }
+#if defined(__linux__)
+    /// Anonymous ring, hand fd() to the consumer process (inherited, over a unix socket or as
+    /// /proc/<pid>/fd/<fd>)
+    static ShmFifo createAnonymous(const std::string& name, uint64_t capacity, uint32_t recordSize = kLengthPrefixed){
+        int fd = ::memfd_create(name.c_str(), 0);
+        if(fd < 0){
+            throw std::runtime_error("Cannot create memfd ring " + name);
+        }
+        return ShmFifo(fd, capacity, recordSize, name);
+    }
+#endif
+    /// Attaches to a ring somebody created before, possibly from another process
+    static ShmFifo attach(const std::string& path){
+        int fd = ::open(path.c_str(), O_RDWR);
+        if(fd < 0){
+            throw std::runtime_error("Cannot open ring " + path);
+        }
+        return ShmFifo(fd, path);
+    }
+    /// Like attach for an inherited descriptor, which stays owned by the caller
+    static ShmFifo attachFd(int fd){
+        return ShmFifo(::dup(fd), "fd " + std::to_string(fd));
+    }
+
+    ShmFifo(ShmFifo&& other) noexcept{
+        *this = std::move(other);
+    }
+    ShmFifo& operator=(ShmFifo&& other) noexcept{
+        std::swap(m_fd, other.m_fd);
+        std::swap(m_mapping, other.m_mapping);
+        std::swap(m_mapped_size, other.m_mapped_size);
+        std::swap(m_header, other.m_header);
+        std::swap(m_data, other.m_data);
+        std::swap(m_push, other.m_push);
+        std::swap(m_pop_cached, other.m_pop_cached);
+        std::swap(m_reserved, other.m_reserved);
+        std::swap(m_pop, other.m_pop);
+        std::swap(m_push_cached, other.m_push_cached);
+        std::swap(m_peeked, other.m_peeked);
+        return *this;
+    }
+    ShmFifo(const ShmFifo&) = delete;
+    ShmFifo& operator=(const ShmFifo&) = delete;
+    ~ShmFifo(){
+        if(m_mapping != nullptr){
+            ::munmap(m_mapping, m_mapped_size);
+        }
+        if(m_fd >= 0){
+            ::close(m_fd);
+        }
+    }
+
+    int fd() const{
+        return m_fd;
+    }
+    uint64_t capacity() const{
+        return m_header->capacity;
+    }
+    uint32_t recordSize() const{
+        return m_header->recordSize;
+    }
+    /// Bytes in the ring including record headers and wrap padding
+    uint64_t size() const{
+        return m_header->pushCursor.load(std::memory_order_acquire) - m_header->popCursor.load(std::memory_order_acquire);
+    }
+    bool empty() const{
+        return size() == 0;
+    }
+
+    /// Producer side: room for one record of size bytes in the ring, nullptr while it is full.
+    /// The record becomes visible to the consumer with commit.
+    void* reserve(uint32_t size){
+        assert(m_header->recordSize == kLengthPrefixed || size == m_header->recordSize);
+        uint64_t capacity = m_header->capacity;
+        uint64_t stride = strideOf(size);
+        if(stride > capacity / 2){
+            throw std::length_error("Record does not fit the ring");
+        }
+        uint64_t offset = m_push % capacity;
+        uint64_t skip = offset + stride > capacity ? capacity - offset : 0;
+        if(capacity - (m_push - m_pop_cached) < skip + stride){
+            m_pop_cached = m_header->popCursor.load(std::memory_order_acquire);
+            if(capacity - (m_push - m_pop_cached) < skip + stride){
+                return nullptr;
+            }
+        }
+        if(skip != 0){
+            // Fixed size records divide the ring, only length prefixed ones wrap like this
+            *reinterpret_cast<uint32_t*>(m_data + offset) = kWrapMarker;
+            offset = 0;
+        }
+        m_reserved = {m_push + skip, size};
+        return m_data + offset + headerOf();
+    }
+    /// Publishes the reserved record, a length prefixed one may have shrunk to size bytes
+    void commit(uint32_t size){
+        assert(size <= m_reserved.second);
+        assert(m_header->recordSize == kLengthPrefixed || size == m_header->recordSize);
+        if(m_header->recordSize == kLengthPrefixed){
+            *reinterpret_cast<uint32_t*>(m_data + m_reserved.first % m_header->capacity) = size;
+        }
+        m_push = m_reserved.first + strideOf(size);
+        m_header->pushCursor.store(m_push, std::memory_order_release);
+    }
+    void commit(){
+        commit(m_reserved.second);
+    }
+    /// One memcpy into the ring
+    /// @return `false` if the ring is full
+    bool push(const void* data, uint32_t size){
+        void* slot = reserve(size);
+        if(slot == nullptr){
+            return false;
+        }
+        std::memcpy(slot, data, size);
+        commit(size);
+        return true;
+    }
+    template<typename T>
+    bool push(const T& record){
+        static_assert(std::is_trivially_copyable<T>::value, "records are copied as bytes");
+        return push(&record, sizeof(T));
+    }
+    /// Producer side: tells the consumer no more records will come
+    void close(){
+        m_header->closed.store(1, std::memory_order_release);
+    }
+    bool closed() const{
+        return m_header->closed.load(std::memory_order_acquire) != 0;
+    }
+
+    /// Consumer side: the oldest record in place and its size, nullptr if the ring is empty.
+    /// Stays in the ring until release.
+    const void* peek(uint32_t& size){
+        if(m_pop == m_push_cached){
+            m_push_cached = m_header->pushCursor.load(std::memory_order_acquire);
+            if(m_pop == m_push_cached){
+                return nullptr;
+            }
+        }
+        uint64_t capacity = m_header->capacity;
+        uint64_t offset = m_pop % capacity;
+        size = m_header->recordSize;
+        if(size == kLengthPrefixed){
+            size = *reinterpret_cast<const uint32_t*>(m_data + offset);
+            if(size == kWrapMarker){
+                m_pop += capacity - offset;
+                offset = 0;
+                size = *reinterpret_cast<const uint32_t*>(m_data);
+            }
+        }
+        m_peeked = strideOf(size);
+        return m_data + offset + headerOf();
+    }
+    void release(){
+        m_pop += m_peeked;
+        m_peeked = 0;
+        m_header->popCursor.store(m_pop, std::memory_order_release);
+    }
+    /// Copies the oldest record out
+    /// @return `false` if the ring is empty
+    bool pop(std::vector<char>& record){
+        uint32_t size = 0;
+        const void* data = peek(size);
+        if(data == nullptr){
+            return false;
+        }
+        record.assign(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+        release();
+        return true;
+    }
+    template<typename T>
+    bool pop(T& record){
+        static_assert(std::is_trivially_copyable<T>::value, "records are copied as bytes");
+        uint32_t size = 0;
+        const void* data = peek(size);
+        if(data == nullptr){
+            return false;
+        }
+        assert(size == sizeof(T));
+        std::memcpy(&record, data, sizeof(T));
+        release();
+        return true;
+    }
+
+private:
+    static constexpr uint64_t kMagic = 0x4f46494648534d52ULL; // "RMSHFIFO"
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kWrapMarker = UINT32_MAX;
+    static constexpr uint64_t kAlign = 8;
+
+    /// Start of the mapping, the ring data follows it
+    struct alignas(64) Header{
+        uint64_t magic;
+        uint32_t version;
+        uint32_t recordSize;
+        uint64_t capacity;
+        std::atomic<uint32_t> closed;
+        alignas(64) std::atomic<uint64_t> pushCursor;
+        alignas(64) std::atomic<uint64_t> popCursor;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "cursors are shared between processes");
+
+    ShmFifo(int fd, uint64_t capacity, uint32_t recordSize, const std::string& name) : m_fd(fd){
+        if(recordSize == kWrapMarker){
+            ::close(fd);
+            throw std::invalid_argument("Record size is reserved");
+        }
+        uint64_t stride = recordSize == kLengthPrefixed ? kAlign : strideFor(recordSize, recordSize);
+        capacity = capacity / stride * stride;
+        if(capacity < 2 * stride || ::ftruncate(fd, static_cast<off_t>(sizeof(Header) + capacity)) != 0){
+            ::close(fd);
+            throw std::runtime_error("Cannot size ring " + name);
+        }
+        map(sizeof(Header) + capacity, name);
+        m_header->magic = kMagic;
+        m_header->version = kVersion;
+        m_header->recordSize = recordSize;
+        m_header->capacity = capacity;
+        m_header->closed.store(0, std::memory_order_relaxed);
+        m_header->pushCursor.store(0, std::memory_order_relaxed);
+        m_header->popCursor.store(0, std::memory_order_release);
+    }
+    ShmFifo(int fd, const std::string& name) : m_fd(fd){
+        struct stat info{};
+        if(fd < 0 || ::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)){
+            if(fd >= 0){
+                ::close(fd);
+            }
+            throw std::runtime_error("Not a ring " + name);
+        }
+        map(static_cast<size_t>(info.st_size), name);
+        if(m_header->magic != kMagic || m_header->version != kVersion ||
+           m_header->capacity + sizeof(Header) > m_mapped_size){
+            throw std::runtime_error("Not a ring " + name);
+        }
+        m_push = m_header->pushCursor.load(std::memory_order_acquire);
+        m_pop = m_header->popCursor.load(std::memory_order_acquire);
+        m_pop_cached = m_pop;
+        m_push_cached = m_push;
+    }
+
+    void map(size_t size, const std::string& name){
+        void* mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if(mapping == MAP_FAILED){
+            ::close(m_fd);
+            m_fd = -1;
+            throw std::runtime_error("Cannot map ring " + name);
+        }
+        m_mapping = mapping;
+        m_mapped_size = size;
+        m_header = static_cast<Header*>(mapping);
+        m_data = static_cast<char*>(mapping) + sizeof(Header);
+    }
+
+    uint64_t headerOf() const{
+        return m_header->recordSize == kLengthPrefixed ? kAlign : 0;
+    }
+    /// Bytes one record of size takes in the ring
+    static uint64_t strideFor(uint32_t recordSize, uint64_t size){
+        uint64_t header = recordSize == kLengthPrefixed ? kAlign : 0;
+        return (header + size + kAlign - 1) / kAlign * kAlign;
+    }
+    uint64_t strideOf(uint64_t size) const{
+        return strideFor(m_header->recordSize, size);
+    }
+
+    int m_fd = -1;
+    void* m_mapping = nullptr;
+    size_t m_mapped_size = 0;
+    Header* m_header = nullptr;
+    char* m_data = nullptr;
+
+    // Producer side, local to this process
+    uint64_t m_push = 0;
+    uint64_t m_pop_cached = 0;
+    std::pair<uint64_t, uint32_t> m_reserved{0, 0};
+
+    // Consumer side, local to this process
+    uint64_t m_pop = 0;
+    uint64_t m_push_cached = 0;
+    uint64_t m_peeked = 0;
+};
+
+#endif //OPENMP_SHMFIFO_H
@@ -6,173 +6,880 @@
 #define OPENMP_THREADEDDUMP_H
 
 #include <iostream>
-#include <deque>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <mutex>
-#include <future>
 #include <string>
-#include <condition_variable>
+#include <thread>
+#include <type_traits>
 #include <fstream>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 #include <sstream>
+#include <stdexcept>
+
+#include "EventCount.h"
+#include "LockFreeFifo.h"
 
 #define CONFIG_FILE_PATH "dump_config.txt"
 
 namespace TD{
-    struct TDQueue;
-    class ThreadedDumpPool;
-    extern TDQueue m_dump_queue;
-    extern std::mutex m_dump_mutex;
-    extern std::condition_variable m_dump_cv;
-    extern bool m_dump_terminate;
-
-    struct TDQueue: public std::deque<std::pair<std::string, std::string>>{
-    public:
-        void safe_emplace_back(const std::pair<std::string, std::string>& data){
-            while(true){
-                std::lock_guard<std::mutex>lk(m_q_mutex);
-                if(this->size() <= 500){
-                    // If the dump thread is slow, stall the main thread
-                    this->emplace_back(data);
-                    return;
-                }
+    /// What a dump stream does when its writer cannot keep up and the queue is full
+    enum class Overflow{
+        Block,      ///< wait for the writer, lossless
+        DropNewest, ///< drop the line being submitted
+        DropOldest, ///< drop the oldest queued line to make room
+        Sample      ///< once the queue is half full keep only every sampleEvery-th line
+    };
+
+    /// Per stream (output file) settings
+    struct TDPolicy{
+        Overflow overflow = Overflow::Block;
+        size_t depth = 500;
+        uint32_t sampleEvery = 10;
+        WaitStrategy wait;
+        bool binary = false; ///< records are written raw for DumpDecoder, text lines are not
+
+        /// Fifo4 and MpmcFifo need two slots, sampling divides by sampleEvery
+        static constexpr size_t kMinDepth = 2;
+
+        /// Throws std::invalid_argument for a policy no queue can be built from
+        void validate() const{
+            if(depth < kMinDepth){
+                throw std::invalid_argument("Dump queue depth must be at least " + std::to_string(kMinDepth) +
+                                            ", got " + std::to_string(depth));
+            }
+            if(overflow == Overflow::Sample && sampleEvery == 0){
+                throw std::invalid_argument("Dump sampling needs sampleEvery of at least 1");
             }
         }
-        void safe_pop_front(){
-            std::lock_guard<std::mutex>lk(m_q_mutex);
-            this->pop_front();
+    };
+
+    /// Per stream counters, summed over the producer threads
+    struct TDStats{
+        uint64_t lines = 0;      ///< submitted, including the dropped ones
+        uint64_t dropped = 0;
+        uint64_t stalled = 0;    ///< submits that had to wait for the writer
+        uint64_t stallNanos = 0;
+
+        void merge(const TDStats& other){
+            lines += other.lines;
+            dropped += other.dropped;
+            stalled += other.stalled;
+            stallNanos += other.stallNanos;
+        }
+    };
+
+    /// A dump line left unformatted: the id of a format string with {} placeholders and the raw
+    /// arguments, 4 bits of type tag each. One cache line, copied into the queue as is and, for
+    /// binary files, into the file.
+    struct DumpRecord{
+        static constexpr uint32_t kMaxArgs = 7;
+        enum Tag : uint32_t{
+            End = 0,
+            Signed,
+            Unsigned,
+            Double
+        };
+
+        uint32_t format;
+        uint32_t tags;
+        uint64_t args[kMaxArgs];
+
+        template<typename... Args>
+        static DumpRecord make(uint32_t format, Args... args){
+            static_assert(sizeof...(Args) <= kMaxArgs, "too many dump arguments");
+            DumpRecord record{format, 0, {}};
+            uint32_t i = 0;
+            (record.set(i++, args), ...);
+            return record;
+        }
+        Tag tag(uint32_t i) const{
+            return i < kMaxArgs ? static_cast<Tag>((tags >> (4 * i)) & 0xf) : End;
+        }
+        /// Renders format with the arguments in place of the placeholders
+        void render(std::ostream& os, const std::string& format) const{
+            uint32_t arg = 0;
+            size_t begin = 0;
+            for(size_t at = format.find("{}"); at != std::string::npos && tag(arg) != End; at = format.find("{}", begin)){
+                os.write(format.data() + begin, static_cast<std::streamsize>(at - begin));
+                switch(tag(arg)){
+                case Signed:
+                    os << static_cast<int64_t>(args[arg]);
+                    break;
+                case Unsigned:
+                    os << args[arg];
+                    break;
+                default:
+                    double value;
+                    std::memcpy(&value, &args[arg], sizeof(value));
+                    os << value;
+                    break;
+                }
+                arg++;
+                begin = at + 2;
+            }
+            os.write(format.data() + begin, static_cast<std::streamsize>(format.size() - begin));
         }
     private:
-        std::mutex m_q_mutex;
+        template<typename T>
+        void set(uint32_t i, T value){
+            static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                          "dump arguments are numbers, dump text with submit");
+            Tag tag;
+            if constexpr(std::is_floating_point<T>::value){
+                double wide = value;
+                std::memcpy(&args[i], &wide, sizeof(wide));
+                tag = Double;
+            }
+            else if constexpr(std::is_enum<T>::value){
+                args[i] = static_cast<uint64_t>(value);
+                tag = std::is_signed<std::underlying_type_t<T>>::value ? Signed : Unsigned;
+            }
+            else{
+                args[i] = static_cast<uint64_t>(value);
+                tag = std::is_signed<T>::value ? Signed : Unsigned;
+            }
+            tags |= static_cast<uint32_t>(tag) << (4 * i);
+        }
     };
+    static_assert(sizeof(DumpRecord) == 64 && std::is_trivially_copyable<DumpRecord>::value,
+                  "Dump record layout must not change");
+
+    /// Start of a binary dump file, the records follow
+    constexpr char kDumpMagic[8] = {'P', 'T', 'D', 'R', 'E', 'C', '0', '1'};
 
-    class ThreadedDump{
+    /// A writer thread's side of the hand-over, shared by the queues of every file it owns
+    struct TDSignals{
+        EventCount work;  ///< wakes the writer
+        EventCount space; ///< wakes producers blocked on a full queue
+        /// Set by the writer from just before it parks until it runs again. Producers read it
+        /// without a fence, so a push racing the writer going to sleep can miss it; the writer
+        /// never parks longer than its flush interval to cover that.
+        alignas(64) std::atomic<bool> parked{false};
+    };
+
+    /// One producer thread's dump lines for one file. Single producer single consumer: only that
+    /// thread pushes and only the writer owning the file pops, so the lines stay in order without
+    /// a lock on either side. DropOldest needs the producer to evict from the front as well, those
+    /// streams use an MpmcFifo instead. Entry is std::string for text lines or DumpRecord, whose
+    /// ring is the thread's preallocated record buffer.
+    template<typename Entry>
+    struct BasicTDQueue{
     public:
-        void init();
-    private:
-        static bool loadConfigFile(std::unordered_set<std::string> &active_files){
-            std::ifstream config_reader(CONFIG_FILE_PATH);
-            if(config_reader.fail()){
-                // no config file
-                std::cout << "No config file found, thread exits!" << "\n";
-                return false;
+        /// A push notifies signals.work only while the writer is parked, once every half depth
+        /// pushes, and when a Block producer has to wait for space; the writer notifies
+        /// signals.space after draining
+        BasicTDQueue(const TDPolicy& policy, TDSignals& signals)
+            : m_policy(policy), m_signals(signals), m_wake_batch(std::max<size_t>(policy.depth / 2, 1)){
+            if(policy.overflow == Overflow::DropOldest){
+                m_shared.reset(new MpmcFifo<Entry>(policy.depth));
             }
             else{
-                std::istringstream ss;
-                std::string line, file_name, status;
-                while(std::getline(config_reader, line)){
-                    ss.clear();
-                    ss.str(line);
-                    if(ss >> file_name >> status && active_files.count(file_name) == 0){
-                        std::cout << file_name << " " << status << "\n";
-                        active_files.insert(file_name);
+                m_ring.reset(new Fifo4<Entry>(policy.depth));
+            }
+        }
+
+        /// Producer side, applies the overflow policy if the queue is full
+        /// @return `false` if the line was dropped
+        bool safe_emplace_back(Entry&& text){
+            bump(m_lines);
+            switch(m_policy.overflow){
+            case Overflow::Block:
+                if(!m_ring->push(std::move(text))){
+                    stall(std::move(text));
+                }
+                announce();
+                return true;
+            case Overflow::DropOldest:
+                while(!m_shared->push(std::move(text))){
+                    Entry oldest;
+                    if(m_shared->pop(oldest)){
+                        bump(m_dropped);
                     }
                     else{
-                        std::cout << "Unmatched line" << "\n";
+                        // The writer holds the front slot half freed
+                        std::this_thread::yield();
                     }
                 }
+                announce();
+                return true;
+            case Overflow::Sample:
+                if(m_ring->size() * 2 >= m_policy.depth && m_sample++ % m_policy.sampleEvery != 0){
+                    bump(m_dropped);
+                    return false;
+                }
+                break;
+            case Overflow::DropNewest:
+                break;
+            }
+            if(!m_ring->push(std::move(text))){
+                bump(m_dropped);
+                return false;
             }
+            announce();
             return true;
         }
-        std::map<std::string, std::ofstream> m_stream_map;
-        uint64_t m_id = 0;
-    };
-
-    class ThreadedDumpPool{
-    public:
-        ThreadedDumpPool(){
-            for(int i = 0; i< thread_num; i++){
-                m_pool.emplace_back(&TD::ThreadedDump::init, TD::ThreadedDump());
+        /// Writer side: whether drain would find anything
+        bool empty() const{
+            return m_shared ? m_shared->empty() : m_ring->empty();
+        }
+        /// Writer side: hands every queued line to write, oldest first
+        /// @return number of lines written
+        template<class Write>
+        size_t drain(Write write){
+            if(m_shared){
+                size_t count = 0;
+                Entry line;
+                while(m_shared->pop(line)){
+                    write(line);
+                    count++;
+                }
+                return count;
+            }
+            auto lines = m_ring->peek(m_ring->capacity());
+            for(size_t i = 0; i < lines.size(); i++){
+                write(lines[i]);
             }
+            m_ring->release(lines.size());
+            return lines.size();
         }
-        static ThreadedDumpPool* get(){
-            std::call_once(m_flag, ThreadedDumpPool::init);
-            return m_instance.get();
+        TDStats stats() const{
+            return {m_lines.load(std::memory_order_relaxed), m_dropped.load(std::memory_order_relaxed),
+                    m_stalled.load(std::memory_order_relaxed), m_stall_nanos.load(std::memory_order_relaxed)};
         }
-        void registerThreadID(uint64_t id){
-            std::lock_guard<std::mutex>lk(m_pool_mutex);
-            m_thread_id.push_back(id);
-            std::cout << "Register thread id: " << id << std::endl;
+    private:
+        /// Counters have a single writer, no need for a locked add
+        static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1){
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
         }
-        void submit(const std::string& dir, const std::string& text){
-            if(m_DtoT_mapping.count(dir) == 0){
-                // new file
-                m_file_count++;
-                m_DtoT_mapping.insert({dir, m_file_count % thread_num}); // round-robin allocate
+        /// Wakes the writer if it is parked, and every half queue regardless so a writer that
+        /// missed the parked flag still hears from a busy producer. Other pushes cost one load.
+        void announce(){
+            if(++m_unannounced >= m_wake_batch || m_signals.parked.load(std::memory_order_relaxed)){
+                m_unannounced = 0;
+                m_signals.work.notifyAll();
             }
-
         }
-        using threadJobType = std::pair<std::string, std::string>;
-        threadJobType queryJob(uint64_t thread_id){ // each thread query for jobs
-
-        }
-    private:
-        static void init(){
-            m_instance.reset(new ThreadedDumpPool());
+        void stall(Entry&& text){
+            auto t1 = std::chrono::steady_clock::now();
+            bump(m_stalled);
+            m_signals.work.notifyAll();
+            while(!m_ring->push(std::move(text))){
+                m_policy.wait.wait(m_signals.space, [this]{ return !m_ring->full(); });
+            }
+            auto t2 = std::chrono::steady_clock::now();
+            bump(m_stall_nanos, std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count());
         }
-        static const int thread_num = 4;
-        static std::once_flag m_flag;
-        static std::unique_ptr<ThreadedDumpPool> m_instance;
-        std::vector<std::thread>m_pool;
-        std::vector<uint64_t>m_thread_id;
-        std::unordered_map<std::string, int> m_DtoT_mapping;
-        std::mutex m_pool_mutex;
-        int m_file_count = 0;
-    };
 
+        TDPolicy m_policy;
+        TDSignals& m_signals;
+        std::unique_ptr<Fifo4<Entry>> m_ring;
+        std::unique_ptr<MpmcFifo<Entry>> m_shared;
+        const size_t m_wake_batch;
+        size_t m_unannounced = 0; // producer only
+        uint64_t m_sample = 0; // producer only
+        std::atomic<uint64_t> m_lines{0};
+        std::atomic<uint64_t> m_dropped{0};
+        std::atomic<uint64_t> m_stalled{0};
+        std::atomic<uint64_t> m_stall_nanos{0};
+    };
+    using TDQueue = BasicTDQueue<std::string>;
+    using TDRecordQueue = BasicTDQueue<DumpRecord>;
 }
 
 /// Multiple writers from multiple threads to multiple readers on multiple threads
 namespace PTD{ // parallel thread dump
     const int thread_num = 3;
 
-    struct DumpQueue{
+    struct DumpStream;
+
+    /// An output file, opened and written only by the writer thread of its shard
+    struct DumpFile{
+        DumpFile(std::string path, uint32_t id, int shard, bool binary)
+            : path(std::move(path)), id(id), shard(shard), binary(binary){}
+
+        std::string path;
+        uint32_t id;
+        int shard;
+        bool binary;
+        std::ofstream out;
+        bool failed = false;
+        bool warned = false;
+        std::vector<std::unique_ptr<DumpStream>> streams; // registration only
+    };
+
+    /// What one producer thread queued for one file, either text lines or records
+    struct DumpStream{
+        DumpStream(DumpFile* file, std::thread::id producer, bool records, const TD::TDPolicy& policy,
+                   TD::TDSignals& signals)
+            : file(file), producer(producer){
+            if(records){
+                this->records.reset(new TD::TDRecordQueue(policy, signals));
+            }
+            else{
+                text.reset(new TD::TDQueue(policy, signals));
+            }
+        }
+        TD::TDStats stats() const{
+            return text ? text->stats() : records->stats();
+        }
+        bool empty() const{
+            return text ? text->empty() : records->empty();
+        }
+        DumpFile* file;
+        std::thread::id producer;
+        std::unique_ptr<TD::TDQueue> text;
+        std::unique_ptr<TD::TDRecordQueue> records;
+        DumpStream* next = nullptr;
+    };
+
+    /// Format strings of the dump records by id. Ids are handed out under the pool's lock, the
+    /// writers look them up without one.
+    class DumpFormats{
     public:
-        void dump(){
-            std::lock_guard<std::mutex>lg(m_q_mutex);
-            while(!m_q.empty()){
+        static constexpr uint32_t kMaxFormats = 4096;
 
-                m_q.pop_front();
+        DumpFormats(): m_table(new std::atomic<const std::string*>[kMaxFormats]){
+            for(uint32_t i = 0; i < kMaxFormats; i++){
+                m_table[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+        /// Caller holds the pool lock
+        uint32_t add(const std::string& format){
+            auto it = m_ids.find(format);
+            if(it != m_ids.end()){
+                return it->second;
+            }
+            auto id = static_cast<uint32_t>(m_texts.size());
+            if(id == kMaxFormats){
+                throw std::length_error("Too many dump formats");
+            }
+            m_texts.push_back(format);
+            m_ids.emplace(format, id);
+            m_table[id].store(&m_texts.back(), std::memory_order_release);
+            return id;
+        }
+        const std::string* get(uint32_t id) const{
+            return id < kMaxFormats ? m_table[id].load(std::memory_order_acquire) : nullptr;
+        }
+        /// One format per line, newlines and backslashes escaped, for DumpDecoder
+        void save(const std::string& path) const{
+            std::ofstream out(path);
+            for(uint32_t id = 0; get(id) != nullptr; id++){
+                for(char c: *get(id)){
+                    if(c == '\n'){
+                        out << "\\n";
+                    }
+                    else if(c == '\\'){
+                        out << "\\\\";
+                    }
+                    else{
+                        out << c;
+                    }
+                }
+                out << "\n";
             }
         }
-        bool empty(){
-            std::lock_guard<std::mutex>lg(m_q_mutex);
-            return m_q.empty();
+        static std::vector<std::string> load(const std::string& path){
+            std::vector<std::string> formats;
+            std::ifstream in(path);
+            std::string line;
+            while(std::getline(in, line)){
+                std::string format;
+                for(size_t i = 0; i < line.size(); i++){
+                    if(line[i] == '\\' && i + 1 < line.size()){
+                        format += line[++i] == 'n' ? '\n' : line[i];
+                    }
+                    else{
+                        format += line[i];
+                    }
+                }
+                formats.push_back(format);
+            }
+            return formats;
         }
     private:
-        std::deque<std::pair<std::string, std::string>> m_q;
-        std::mutex m_q_mutex;
-        std::condition_variable m_q_cv;
+        std::unique_ptr<std::atomic<const std::string*>[]> m_table;
+        std::deque<std::string> m_texts;
+        std::unordered_map<std::string, uint32_t> m_ids;
     };
 
+    /// One writer thread's share of the files
+    struct DumpQueue{
+    public:
+        /// Hands a new stream to the writer, streams are only ever added
+        void add(DumpStream* stream){
+            DumpStream* head = m_streams.load(std::memory_order_relaxed);
+            do{
+                stream->next = head;
+            }while(!m_streams.compare_exchange_weak(head, stream, std::memory_order_release, std::memory_order_relaxed));
+        }
+        /// Writes out every queued line, writer thread only
+        /// @return number of lines written
+        size_t dump(){
+            size_t written = 0;
+            for(DumpStream* stream = m_streams.load(std::memory_order_acquire); stream != nullptr; stream = stream->next){
+                DumpFile& file = *stream->file;
+                if(stream->text){
+                    written += stream->text->drain([this, &file](const std::string& line){ write(file, line); });
+                }
+                else{
+                    written += stream->records->drain([this, &file](const TD::DumpRecord& record){ write(file, record); });
+                }
+            }
+            return written;
+        }
+        /// Whether dump would write anything, writer thread only
+        bool pending() const{
+            for(DumpStream* stream = m_streams.load(std::memory_order_acquire); stream != nullptr; stream = stream->next){
+                if(!stream->empty()){
+                    return true;
+                }
+            }
+            return false;
+        }
+        /// Pushes the written lines to the OS
+        void flush(){
+            for(DumpFile* file: m_open){
+                file->out.flush();
+            }
+        }
+        /// Last flush, binary files get their format table next to them
+        void close(){
+            flush();
+            for(DumpFile* file: m_open){
+                if(file->binary){
+                    m_formats->save(file->path + ".formats");
+                }
+            }
+        }
+        TD::TDSignals m_signals;
+        const DumpFormats* m_formats = nullptr;
+    private:
+        bool open(DumpFile& file){
+            if(!file.out.is_open() && !file.failed){
+                file.out.open(file.path, file.binary ? std::ios::binary | std::ios::trunc : std::ios::trunc);
+                file.failed = !file.out.is_open();
+                if(file.failed){
+                    std::cerr << "Cannot open dump file " << file.path << ", its lines are dropped" << "\n";
+                    return false;
+                }
+                if(file.binary){
+                    file.out.write(TD::kDumpMagic, sizeof(TD::kDumpMagic));
+                }
+                m_open.push_back(&file);
+            }
+            return !file.failed;
+        }
+        void write(DumpFile& file, const std::string& line){
+            if(file.binary){
+                if(!file.warned){
+                    std::cerr << "Dump file " << file.path << " is binary, its text lines are dropped" << "\n";
+                    file.warned = true;
+                }
+                return;
+            }
+            if(open(file)){
+                file.out << line;
+            }
+        }
+        void write(DumpFile& file, const TD::DumpRecord& record){
+            if(!open(file)){
+                return;
+            }
+            if(file.binary){
+                file.out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+                return;
+            }
+            const std::string* format = m_formats->get(record.format);
+            if(format != nullptr){
+                record.render(file.out, *format);
+            }
+        }
+
+        std::atomic<DumpStream*> m_streams{nullptr};
+        std::vector<DumpFile*> m_open; // writer thread only
+    };
+
+    /// Sharded dump writers. Every file is owned by one writer thread (round robin over the files
+    /// in order of first use) so its writes need no lock. Every producer thread gets its own
+    /// queue per file, found through a thread local cache, so submit and dump take no lock either
+    /// except the first time a thread dumps to a file. What happens when a writer falls behind is
+    /// chosen per file with a TD::TDPolicy.
+    /// An idle writer polls for the spin time of the default policy's WaitStrategy, then parks
+    /// for at most kFlushInterval; producers only make a system call to wake it while it is
+    /// parked (see TD::BasicTDQueue). Written lines are flushed to the OS kFlushInterval after the
+    /// first of them, not every time the writer runs dry.
+    /// submit queues formatted text. dump queues a DumpRecord instead, a format id and numbers
+    /// copied into the producer's preallocated ring, and leaves the formatting to the writer, or
+    /// to DumpDecoder for binary files. Text lines and records of one file are two streams, their
+    /// relative order in the file is not kept.
     class ThreadedDumpPool{
     public:
-        ThreadedDumpPool(): m_running(true){
-            for(int i = 0; i < PTD::thread_num; i++){
-                m_threads.emplace_back(&ThreadedDumpPool::threadProcess, i);
+        static constexpr std::chrono::milliseconds kFlushInterval{20};
+
+        /// Throws std::invalid_argument if defaults fails TDPolicy::validate
+        explicit ThreadedDumpPool(int writers = PTD::thread_num, const TD::TDPolicy& defaults = TD::TDPolicy{})
+            : m_qs(writers), m_defaults(validated(defaults)), m_id(nextPoolId()), m_running(true){
+            for(auto& q: m_qs){
+                q.m_formats = &m_formats;
+            }
+            for(int i = 0; i < writers; i++){
+                m_threads.emplace_back(&ThreadedDumpPool::threadProcess, this, i);
+            }
+        }
+        ThreadedDumpPool(const ThreadedDumpPool&) = delete;
+        ThreadedDumpPool& operator=(const ThreadedDumpPool&) = delete;
+        ~ThreadedDumpPool(){
+            stop();
+        }
+
+        /// Overflow policy, depth and encoding for file, applies to the streams created after the
+        /// call so set it before the first use of the file. Throws std::invalid_argument if policy
+        /// fails TDPolicy::validate, the file keeps its previous policy then.
+        void setPolicy(const std::string& file, const TD::TDPolicy& policy){
+            policy.validate();
+            std::lock_guard<std::mutex> lg(m_mutex);
+            m_policies[file] = policy;
+        }
+        /// Queues text to be appended to file, from any thread
+        /// @return `false` if the overflow policy dropped it
+        bool submit(const std::string& file, std::string text){
+            return streamFor(file).text->safe_emplace_back(std::move(text));
+        }
+
+        /// Id of file for dump, look it up once
+        uint32_t fileId(const std::string& file){
+            std::lock_guard<std::mutex> lg(m_mutex);
+            return fileFor(file).id;
+        }
+        /// Id of a format string for dump, {} stands for the next argument
+        uint32_t formatId(const std::string& format){
+            std::lock_guard<std::mutex> lg(m_mutex);
+            return m_formats.add(format);
+        }
+        /// Queues format with up to DumpRecord::kMaxArgs numbers for file, from any thread. Does
+        /// not allocate after the thread's first record to the file.
+        /// @return `false` if the overflow policy dropped it
+        template<typename... Args>
+        bool dump(uint32_t file, uint32_t format, Args... args){
+            return recordStreamFor(file).records->safe_emplace_back(TD::DumpRecord::make(format, args...));
+        }
+
+        /// Counters of file over all producer threads so far
+        TD::TDStats stats(const std::string& file){
+            std::lock_guard<std::mutex> lg(m_mutex);
+            TD::TDStats total;
+            auto it = m_files.find(file);
+            if(it != m_files.end()){
+                for(const auto& stream: it->second->streams){
+                    total.merge(stream->stats());
+                }
+            }
+            return total;
+        }
+        /// One line of counters per file
+        void report(std::ostream& os){
+            std::vector<std::string> files;
+            {
+                std::lock_guard<std::mutex> lg(m_mutex);
+                for(const auto& file: m_files){
+                    files.push_back(file.first);
+                }
+            }
+            std::sort(files.begin(), files.end());
+            for(const auto& file: files){
+                TD::TDStats total = stats(file);
+                os << file << " lines " << total.lines << " dropped " << total.dropped << " stalled " << total.stalled
+                   << " stall_us " << total.stallNanos / 1000 << "\n";
+            }
+        }
+        /// Writes out everything submitted so far and joins the writers. Producers must have
+        /// stopped submitting.
+        void stop(){
+            if(!m_running.exchange(false)){
+                return;
+            }
+            for(auto& q: m_qs){
+                q.m_signals.work.notifyAll();
+            }
+            for(auto& thread: m_threads){
+                thread.join();
             }
         }
 
     private:
+        static const TD::TDPolicy& validated(const TD::TDPolicy& policy){
+            policy.validate();
+            return policy;
+        }
+        static uint64_t nextPoolId(){
+            static std::atomic<uint64_t> id{0};
+            return ++id;
+        }
+
+        /// This thread's text stream for file. The last one used is checked first, then a per
+        /// thread map keyed by pool so threads writing to several pools only take m_mutex on first
+        /// use. Pool ids are never reused, so entries of a stopped pool are never looked up again;
+        /// they go with the thread.
+        DumpStream& streamFor(const std::string& file){
+            struct Last{
+                uint64_t pool = 0;
+                const std::string* file = nullptr;
+                DumpStream* stream = nullptr;
+            };
+            thread_local Last last;
+            if(last.pool == m_id && *last.file == file){
+                return *last.stream;
+            }
+            thread_local std::unordered_map<uint64_t, std::unordered_map<std::string, DumpStream*>> cache;
+            auto& streams = cache[m_id];
+            auto it = streams.find(file);
+            if(it == streams.end()){
+                std::lock_guard<std::mutex> lg(m_mutex);
+                it = streams.emplace(file, registerStream(fileFor(file), false)).first;
+            }
+            last = {m_id, &it->second->file->path, it->second};
+            return *it->second;
+        }
+        /// This thread's record stream for a file id, cached the same way
+        DumpStream& recordStreamFor(uint32_t file){
+            struct Last{
+                uint64_t pool = 0;
+                uint32_t file = 0;
+                DumpStream* stream = nullptr;
+            };
+            thread_local Last last;
+            if(last.pool == m_id && last.file == file){
+                return *last.stream;
+            }
+            thread_local std::unordered_map<uint64_t, std::vector<DumpStream*>> cache;
+            auto& streams = cache[m_id];
+            if(file >= streams.size()){
+                streams.resize(file + 1, nullptr);
+            }
+            if(streams[file] == nullptr){
+                std::lock_guard<std::mutex> lg(m_mutex);
+                if(file >= m_file_list.size()){
+                    throw std::out_of_range("Unknown dump file id " + std::to_string(file));
+                }
+                streams[file] = registerStream(*m_file_list[file], true);
+            }
+            last = {m_id, file, streams[file]};
+            return *streams[file];
+        }
+        /// Caller holds m_mutex
+        const TD::TDPolicy& policyFor(const std::string& file) const{
+            auto policy = m_policies.find(file);
+            return policy != m_policies.end() ? policy->second : m_defaults;
+        }
+        DumpFile& fileFor(const std::string& file){
+            auto& owner = m_files[file];
+            if(!owner){
+                auto id = static_cast<uint32_t>(m_file_list.size());
+                owner.reset(new DumpFile(file, id, static_cast<int>(id % m_qs.size()), policyFor(file).binary));
+                m_file_list.push_back(owner.get());
+            }
+            return *owner;
+        }
+        DumpStream* registerStream(DumpFile& file, bool records){
+            auto producer = std::this_thread::get_id();
+            for(const auto& stream: file.streams){
+                if(stream->producer == producer && (stream->records != nullptr) == records){
+                    return stream.get();
+                }
+            }
+            DumpQueue& q = m_qs[file.shard];
+            file.streams.emplace_back(new DumpStream(&file, producer, records, policyFor(file.path), q.m_signals));
+            q.add(file.streams.back().get());
+            return file.streams.back().get();
+        }
+
         void threadProcess(int threadID){
+            DumpQueue& q = m_qs[threadID]; // threadID access is unique to each thread
+            TD::TDSignals& signals = q.m_signals;
+            using Clock = std::chrono::steady_clock;
+            auto flushDue = Clock::time_point::max(); // set by the first line written after a flush
             while(true){
-                std::unique_lock<std::mutex> lk(m_mutex);
-                m_cv.wait(lk, !m_qs[threadID].empty());
-                if(!m_running) return;
-                lk.unlock();
+                bool stopping = !m_running.load(std::memory_order_acquire);
+                if(q.dump() > 0){
+                    signals.space.notifyAll();
+                    if(flushDue == Clock::time_point::max()){
+                        flushDue = Clock::now() + kFlushInterval;
+                    }
+                    continue;
+                }
+                if(stopping){
+                    q.close();
+                    return;
+                }
+                auto now = Clock::now();
+                if(now >= flushDue){
+                    q.flush();
+                    flushDue = Clock::time_point::max();
+                }
+                if(poll(q, now)){
+                    continue;
+                }
+                // Announce the wait, then look again so a line queued in between is not missed.
+                // The prepareWait RMW orders the parked store before the second look.
+                signals.parked.store(true, std::memory_order_relaxed);
+                uint32_t key = signals.work.prepareWait();
+                if(!q.pending() && m_running.load(std::memory_order_acquire)){
+                    signals.work.waitUntil(key, std::min(flushDue, Clock::now() + kFlushInterval));
+                }
+                signals.parked.store(false, std::memory_order_relaxed);
+            }
+        }
+        /// Looks for queued lines for the default wait strategy's spin time
+        /// @return `true` if there are some
+        bool poll(const DumpQueue& q, std::chrono::steady_clock::time_point now) const{
+            auto end = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_defaults.wait.spin);
+            for(uint32_t i = 1; now < end; i++){
+                if(q.pending()){
+                    return true;
+                }
+                cpuRelax();
+                if((i & 63) == 0){
+                    now = std::chrono::steady_clock::now();
+                }
+            }
+            return false;
+        }
 
-                m_qs[threadID].dump(); // threadID access is unique to each thread
+        std::vector<DumpQueue> m_qs;
+        TD::TDPolicy m_defaults;
+        uint64_t m_id;
+        std::atomic<bool> m_running;
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex; // registration only
+        std::unordered_map<std::string, std::unique_ptr<DumpFile>> m_files;
+        std::vector<DumpFile*> m_file_list; // by id
+        std::unordered_map<std::string, TD::TDPolicy> m_policies;
+        DumpFormats m_formats;
+    };
+}
 
+namespace TD{
+    /// The process wide dump pool. If CONFIG_FILE_PATH exists only the files listed in it are
+    /// dumped, otherwise all of them. A config line is "file status [depth]", where status is the
+    /// overflow policy: block, drop_newest, drop_oldest or sample:N (any other status blocks). A
+    /// depth below TDPolicy::kMinDepth is reported and the default depth kept.
+    class ThreadedDumpPool{
+    public:
+        static constexpr uint32_t kInactive = UINT32_MAX;
+
+        static ThreadedDumpPool* get(){
+            std::call_once(m_flag, ThreadedDumpPool::init);
+            return m_instance.get();
+        }
+        bool submit(const std::string& dir, std::string text){
+            if(m_filtered && m_active_files.count(dir) == 0){
+                return false;
             }
+            return m_pool.submit(dir, std::move(text));
         }
-        std::vector<std::thread> m_threads;
-        std::vector<DumpQueue> m_qs;
-        std::mutex m_mutex;
-        std::condition_variable m_cv;
-        bool m_running;
+        /// kInactive for a file the config leaves out, dump drops its records
+        uint32_t fileId(const std::string& dir){
+            if(m_filtered && m_active_files.count(dir) == 0){
+                return kInactive;
+            }
+            return m_pool.fileId(dir);
+        }
+        uint32_t formatId(const std::string& format){
+            return m_pool.formatId(format);
+        }
+        template<typename... Args>
+        bool dump(uint32_t file, uint32_t format, Args... args){
+            if(file == kInactive){
+                return false;
+            }
+            return m_pool.dump(file, format, args...);
+        }
+        void setPolicy(const std::string& dir, const TDPolicy& policy){
+            m_pool.setPolicy(dir, policy);
+        }
+        TDStats stats(const std::string& dir){
+            return m_pool.stats(dir);
+        }
+        void report(std::ostream& os){
+            m_pool.report(os);
+        }
+    private:
+        ThreadedDumpPool(): m_pool(thread_num){
+            std::unordered_map<std::string, TDPolicy> policies;
+            m_filtered = loadConfigFile(m_active_files, policies);
+            for(const auto& policy: policies){
+                m_pool.setPolicy(policy.first, policy.second);
+            }
+        }
+
+        static void init(){
+            m_instance.reset(new ThreadedDumpPool());
+        }
+        static bool loadConfigFile(std::unordered_set<std::string> &active_files,
+                                   std::unordered_map<std::string, TDPolicy> &policies){
+            std::ifstream config_reader(CONFIG_FILE_PATH);
+            if(config_reader.fail()){
+                // no config file
+                std::cout << "No config file found, dumping all files!" << "\n";
+                return false;
+            }
+            else{
+                std::istringstream ss;
+                std::string line, file_name, status;
+                while(std::getline(config_reader, line)){
+                    ss.clear();
+                    ss.str(line);
+                    if(ss >> file_name >> status && active_files.count(file_name) == 0){
+                        std::cout << file_name << " " << status << "\n";
+                        active_files.insert(file_name);
+                        TDPolicy& policy = policies[file_name];
+                        if(status == "drop_newest"){
+                            policy.overflow = Overflow::DropNewest;
+                        }
+                        else if(status == "drop_oldest"){
+                            policy.overflow = Overflow::DropOldest;
+                        }
+                        else if(status.compare(0, 6, "sample") == 0){
+                            policy.overflow = Overflow::Sample;
+                            if(status.size() > 7){
+                                policy.sampleEvery = std::max(1, std::atoi(status.c_str() + 7));
+                            }
+                        }
+                        long long depth = 0;
+                        if(ss >> depth){
+                            if(depth >= static_cast<long long>(TDPolicy::kMinDepth)){
+                                policy.depth = static_cast<size_t>(depth);
+                            }
+                            else{
+                                std::cerr << "Dump queue depth of " << file_name << " must be at least "
+                                          << TDPolicy::kMinDepth << ", got " << depth << ", keeping "
+                                          << policy.depth << "\n";
+                            }
+                        }
+                    }
+                    else{
+                        std::cout << "Unmatched line" << "\n";
+                    }
+                }
+            }
+            return true;
+        }
+        static const int thread_num = 4;
+        inline static std::once_flag m_flag;
+        inline static std::unique_ptr<ThreadedDumpPool> m_instance;
+        std::unordered_set<std::string> m_active_files;
+        bool m_filtered = false;
+        PTD::ThreadedDumpPool m_pool;
     };
 }
 
@@ -0,0 +1,287 @@
+//
+// Created by Han on 2024/5/4.
+//
+
+#ifndef OPENMP_TOPOLOGY_H
+#define OPENMP_TOPOLOGY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// CPU and NUMA layout of the host, read from sysfs on Linux. Anywhere else (or when sysfs is
+/// not readable) every CPU is reported on core = cpu, package 0, node 0.
+class Topology{
+public:
+    struct Cpu{
+        int id;
+        int core;
+        int package;
+        int node;
+    };
+
+    static const Topology& get(){
+        static Topology topology = discover();
+        return topology;
+    }
+
+    const std::vector<Cpu>& cpus() const{
+        return m_cpus;
+    }
+
+    int nodeOf(int cpu) const{
+        for(auto& info: m_cpus){
+            if(info.id == cpu){
+                return info.node;
+            }
+        }
+        return 0;
+    }
+
+    /// Parses sysfs cpu lists such as "0-3,8,10-11"
+    static std::vector<int> parseList(const std::string& list){
+        std::vector<int> result;
+        std::stringstream ss(list);
+        std::string range;
+        while(std::getline(ss, range, ',')){
+            if(range.empty() || range == "\n"){
+                continue;
+            }
+            auto dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for(int cpu = first; cpu <= last; cpu++){
+                result.push_back(cpu);
+            }
+        }
+        return result;
+    }
+
+private:
+    static bool readLine(const std::string& path, std::string& line){
+        std::ifstream file(path);
+        return static_cast<bool>(std::getline(file, line));
+    }
+
+    static int readInt(const std::string& path, int fallback){
+        std::string line;
+        return readLine(path, line) && !line.empty() ? std::stoi(line) : fallback;
+    }
+
+    static Topology discover(){
+        Topology topology;
+        const std::string cpuRoot = "/sys/devices/system/cpu/";
+        const std::string nodeRoot = "/sys/devices/system/node/";
+        std::string line;
+        std::vector<int> online;
+        if(readLine(cpuRoot + "online", line)){
+            online = parseList(line);
+        }
+        if(online.empty()){
+            unsigned count = std::max(1u, std::thread::hardware_concurrency());
+            for(unsigned i = 0; i < count; i++){
+                online.push_back(static_cast<int>(i));
+            }
+        }
+        std::map<int, int> nodeOfCpu;
+        for(int node = 0; readLine(nodeRoot + "node" + std::to_string(node) + "/cpulist", line); node++){
+            for(int cpu: parseList(line)){
+                nodeOfCpu[cpu] = node;
+            }
+        }
+        for(int cpu: online){
+            std::string topologyDir = cpuRoot + "cpu" + std::to_string(cpu) + "/topology/";
+            topology.m_cpus.push_back(Cpu{
+                cpu,
+                readInt(topologyDir + "core_id", cpu),
+                readInt(topologyDir + "physical_package_id", 0),
+                nodeOfCpu.count(cpu) ? nodeOfCpu[cpu] : 0});
+        }
+        return topology;
+    }
+
+    std::vector<Cpu> m_cpus;
+};
+
+/// Where pool workers run. Compact fills one node (and each core's hyper-threads) before the
+/// next, scatter spreads consecutive workers over nodes, packages and cores, explicit takes a
+/// CPU list. Workers beyond the number of CPUs wrap around.
+struct PlacementPolicy{
+    enum class Kind{
+        None,
+        Compact,
+        Scatter,
+        Explicit
+    };
+
+    Kind kind = Kind::None;
+    std::vector<int> cpus;
+
+    static PlacementPolicy none(){
+        return PlacementPolicy{};
+    }
+    static PlacementPolicy compact(){
+        return PlacementPolicy{Kind::Compact, {}};
+    }
+    static PlacementPolicy scatter(){
+        return PlacementPolicy{Kind::Scatter, {}};
+    }
+    static PlacementPolicy explicitList(std::vector<int> cpuList){
+        return PlacementPolicy{Kind::Explicit, std::move(cpuList)};
+    }
+
+    /// CPU for the given worker, -1 when the worker is not pinned
+    int cpuFor(int worker, const Topology& topology = Topology::get()) const{
+        std::vector<int> order = cpuOrder(topology);
+        return order.empty() ? -1 : order[static_cast<size_t>(worker) % order.size()];
+    }
+
+    std::vector<int> cpuOrder(const Topology& topology) const{
+        std::vector<Topology::Cpu> sorted = topology.cpus();
+        std::vector<int> order;
+        switch(kind){
+            case Kind::None:
+                break;
+            case Kind::Explicit:
+                order = cpus;
+                break;
+            case Kind::Compact:
+                std::sort(sorted.begin(), sorted.end(), [](const Topology::Cpu& a, const Topology::Cpu& b){
+                    return std::tie(a.node, a.package, a.core, a.id) < std::tie(b.node, b.package, b.core, b.id);
+                });
+                for(auto& cpu: sorted){
+                    order.push_back(cpu.id);
+                }
+                break;
+            case Kind::Scatter:{
+                // Deal round-robin from one compact list per node, one core per visit
+                std::map<int, std::vector<Topology::Cpu>> perNode;
+                for(auto& cpu: sorted){
+                    perNode[cpu.node].push_back(cpu);
+                }
+                std::vector<std::vector<int>> lists;
+                for(auto& node: perNode){
+                    auto& list = node.second;
+                    // Rank of the CPU among its core's hyper-threads first, so cores fill before siblings
+                    std::map<std::pair<int, int>, int> seen;
+                    std::vector<std::pair<int, Topology::Cpu>> ranked;
+                    for(auto& cpu: list){
+                        ranked.emplace_back(seen[{cpu.package, cpu.core}]++, cpu);
+                    }
+                    std::sort(ranked.begin(), ranked.end(), [](const std::pair<int, Topology::Cpu>& a, const std::pair<int, Topology::Cpu>& b){
+                        return std::tie(a.first, a.second.package, a.second.core, a.second.id) <
+                               std::tie(b.first, b.second.package, b.second.core, b.second.id);
+                    });
+                    lists.emplace_back();
+                    for(auto& cpu: ranked){
+                        lists.back().push_back(cpu.second.id);
+                    }
+                }
+                for(size_t i = 0; order.size() < sorted.size(); i++){
+                    for(auto& list: lists){
+                        if(i < list.size()){
+                            order.push_back(list[i]);
+                        }
+                    }
+                }
+                break;
+            }
+        }
+        return order;
+    }
+};
+
+/// Pins the calling thread, false if the platform or the CPU does not allow it
+inline bool pinCurrentThread(int cpu){
+#if defined(__linux__)
+    if(cpu < 0 || cpu >= CPU_SETSIZE){
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+/// Allocates whole pages bound to one NUMA node with mbind, without a libnuma dependency.
+/// Falls back to unbound pages (first touch) if binding is not possible.
+inline void* allocateOnNode(size_t bytes, int node){
+#if defined(__linux__)
+    void* memory = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED){
+        throw std::bad_alloc();
+    }
+    if(node >= 0 && node < 64){
+        const unsigned long mpolBind = 2; // MPOL_BIND from <numaif.h>
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, memory, bytes, mpolBind, &mask, sizeof(mask) * 8, 0);
+    }
+    return memory;
+#else
+    (void)node;
+    return ::operator new(bytes);
+#endif
+}
+
+inline void deallocateOnNode(void* memory, size_t bytes){
+#if defined(__linux__)
+    ::munmap(memory, bytes);
+#else
+    (void)bytes;
+    ::operator delete(memory);
+#endif
+}
+
+/// Allocator binding its memory to one NUMA node, e.g. for the state of the modules a pinned
+/// worker steps. Every allocation takes whole pages, so use it for large blocks such as
+/// ModuleArena blocks or big vectors, not for node based containers.
+template<typename T>
+class NodeAllocator{
+public:
+    using value_type = T;
+
+    explicit NodeAllocator(int node = 0) : m_node(node){}
+    template<typename U>
+    NodeAllocator(const NodeAllocator<U>& other) : m_node(other.node()){}
+
+    T* allocate(size_t count){
+        return static_cast<T*>(allocateOnNode(count * sizeof(T), m_node));
+    }
+    void deallocate(T* pointer, size_t count){
+        deallocateOnNode(pointer, count * sizeof(T));
+    }
+    int node() const{
+        return m_node;
+    }
+    template<typename U>
+    bool operator==(const NodeAllocator<U>& other) const{
+        return m_node == other.node();
+    }
+    template<typename U>
+    bool operator!=(const NodeAllocator<U>& other) const{
+        return m_node != other.node();
+    }
+private:
+    int m_node;
+};
+
+#endif //OPENMP_TOPOLOGY_H
@@ -0,0 +1,188 @@
+//
+// Created by Han on 2024/3/16.
+//
+
+#ifndef OPENMP_TRACE_H
+#define OPENMP_TRACE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// 0 compiles every FACTORY_TRACE away, otherwise records up to and including this level
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+
+#ifndef TRACE_FILE_PATH
+#define TRACE_FILE_PATH "trace.bin"
+#endif
+
+namespace Trace{
+    enum Level : uint32_t{
+        Info = 1,
+        Debug = 2,
+        Verbose = 3
+    };
+
+    enum Event : uint32_t{
+        CycleStart = 0,
+        ConnectUpdate,
+        ModuleARun,
+        ModuleAReceive,
+        ModuleBRun,
+        ModuleBWrite,
+        EventCount
+    };
+
+    inline const char* EventName(uint32_t event){
+        static const char* names[EventCount] = {
+            "CycleStart",
+            "ConnectUpdate",
+            "ModuleARun",
+            "ModuleAReceive",
+            "ModuleBRun",
+            "ModuleBWrite"
+        };
+        return event < EventCount ? names[event] : "Unknown";
+    }
+
+    /// Fixed size binary record, written to the trace file as is
+    struct Record{
+        uint64_t cycle;
+        uint32_t module_id;
+        uint32_t event_id;
+        uint64_t payload;
+    };
+    static_assert(sizeof(Record) == 24, "Trace record layout must not change");
+
+    constexpr uint32_t kUnregistered = UINT32_MAX;
+
+    /// Owns the trace file. Threads hand over full buffers, a background thread writes them out.
+    /// Module names are interned to ids and written to TRACE_FILE_PATH.names on shutdown.
+    class Sink{
+    public:
+        static Sink& get(){
+            static Sink sink;
+            return sink;
+        }
+
+        uint32_t registerModule(const std::string& name){
+            std::lock_guard<std::mutex> lg(m_mutex);
+            auto it = m_module_ids.find(name);
+            if(it != m_module_ids.end()){
+                return it->second;
+            }
+            auto id = static_cast<uint32_t>(m_module_names.size());
+            m_module_names.push_back(name);
+            m_module_ids.emplace(name, id);
+            return id;
+        }
+
+        void submit(std::vector<Record>&& buffer){
+            {
+                std::lock_guard<std::mutex> lg(m_mutex);
+                m_full.emplace_back(std::move(buffer));
+            }
+            m_cv.notify_one();
+        }
+
+        ~Sink(){
+            {
+                std::lock_guard<std::mutex> lg(m_mutex);
+                m_running = false;
+            }
+            m_cv.notify_one();
+            m_writer.join();
+
+            std::ofstream names(std::string(TRACE_FILE_PATH) + ".names");
+            for(auto& name: m_module_names){
+                names << name << "\n";
+            }
+        }
+
+    private:
+        Sink() : m_file(TRACE_FILE_PATH, std::ios::binary | std::ios::trunc){
+            m_writer = std::thread(&Sink::writerProcess, this);
+        }
+
+        void writerProcess(){
+            std::unique_lock<std::mutex> lk(m_mutex);
+            while(true){
+                m_cv.wait(lk, [this]{ return !m_full.empty() || !m_running; });
+                while(!m_full.empty()){
+                    auto buffer = std::move(m_full.front());
+                    m_full.pop_front();
+                    lk.unlock();
+                    m_file.write(reinterpret_cast<const char*>(buffer.data()),
+                                 static_cast<std::streamsize>(buffer.size() * sizeof(Record)));
+                    lk.lock();
+                }
+                if(!m_running){
+                    m_file.flush();
+                    return;
+                }
+            }
+        }
+
+        std::ofstream m_file;
+        std::thread m_writer;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<std::vector<Record>> m_full;
+        std::vector<std::string> m_module_names;
+        std::unordered_map<std::string, uint32_t> m_module_ids;
+        bool m_running = true;
+    };
+
+    /// Per thread record buffer, only the hand over of a full buffer takes the sink lock
+    class ThreadBuffer{
+    public:
+        static constexpr size_t kRecords = 4096;
+
+        ThreadBuffer() : m_sink(Sink::get()){
+            m_records.reserve(kRecords);
+        }
+        ~ThreadBuffer(){
+            if(!m_records.empty()){
+                m_sink.submit(std::move(m_records));
+            }
+        }
+        void append(uint64_t cycle, uint32_t module_id, uint32_t event_id, uint64_t payload){
+            m_records.push_back(Record{cycle, module_id, event_id, payload});
+            if(m_records.size() == kRecords){
+                m_sink.submit(std::move(m_records));
+                m_records = std::vector<Record>();
+                m_records.reserve(kRecords);
+            }
+        }
+    private:
+        Sink& m_sink; // constructed first, so it outlives every thread buffer
+        std::vector<Record> m_records;
+    };
+
+    inline void Append(uint64_t cycle, uint32_t module_id, uint32_t event_id, uint64_t payload){
+        thread_local ThreadBuffer buffer;
+        buffer.append(cycle, module_id, event_id, payload);
+    }
+}
+
+/// Arguments are not evaluated unless the level is compiled in
+#if TRACE_LEVEL > 0
+#define FACTORY_TRACE(level, cycle, module_id, event_id, payload)                                    \
+    do{                                                                                              \
+        if constexpr ((level) <= TRACE_LEVEL){                                                       \
+            ::Trace::Append((cycle), (module_id), (event_id), static_cast<uint64_t>(payload));       \
+        }                                                                                            \
+    }while(0)
+#else
+#define FACTORY_TRACE(level, cycle, module_id, event_id, payload) do{}while(0)
+#endif
+
+#endif //OPENMP_TRACE_H
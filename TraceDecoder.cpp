@@ -0,0 +1,37 @@
+//
+// Created by Han on 2024/3/16.
+//
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Trace.h"
+
+/// Renders a binary trace written by Trace::Sink as text
+/// usage: TraceDecoder [trace.bin]
+int main(int argc, char* argv[]){
+    std::string path = argc > 1 ? argv[1] : TRACE_FILE_PATH;
+    std::ifstream trace(path, std::ios::binary);
+    if(trace.fail()){
+        std::cout << "Cannot open " << path << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> module_names;
+    std::ifstream names(path + ".names");
+    std::string line;
+    while(std::getline(names, line)){
+        module_names.push_back(line);
+    }
+
+    Trace::Record record{};
+    while(trace.read(reinterpret_cast<char*>(&record), sizeof(record))){
+        std::cout << "cycle " << record.cycle << " "
+                  << (record.module_id < module_names.size() ? module_names[record.module_id] : std::to_string(record.module_id))
+                  << " " << Trace::EventName(record.event_id)
+                  << " " << record.payload << "\n";
+    }
+    return 0;
+}
@@ -1,7 +1,8 @@
 
 #include "/usr/local/opt/libomp/include/omp.h"
 #include "Factory.h"
-//#include "ThreadedDump.h"
+#include "CycleEngine.h"
+#include "ThreadedDump.h"
 #include "ParallelLib.h"
 #include "LockFreeFifo.h"
 
@@ -63,35 +64,32 @@ void compactMemoryAllocation(){
 }
 
 //// CRTP
-void CRTPExample(){
-    auto container = ModuleContainer::GetModuleContainer();
+using ExampleGraph = ModuleGraph<ModuleList<ModuleA, ModuleB>, ConnectList<AtoBConnectType, BtoAConnectType>>;
 
-    /// Connect Initialisation
-    using AtoBConnectType = Connect<ModuleAModuleBConnect, ModuleA, ModuleB>;
-    using BtoAConnectType = Connect<ModuleBModuleAConnect, ModuleB, ModuleA>;
-    std::shared_ptr<AtoBConnectType> AtoBConnect = std::make_shared<AtoBConnectType>(container.moduleA, container.moduleB);
-    std::shared_ptr<BtoAConnectType> BtoAConnect = std::make_shared<BtoAConnectType>(container.moduleB, container.moduleA);
+void CRTPExample(){
+    /// Modules and connects are created and wired by the graph
+    ExampleGraph graph;
+    graph.Get<BtoAConnectType>().SetLatency(2);
 
-    /// Connect the modules
-    container.moduleA->m_AtoBConnect = AtoBConnect;
-    container.moduleB->m_AtoBConnect = AtoBConnect;
-    container.moduleA->m_BtoAConnect = BtoAConnect;
-    container.moduleB->m_BtoAConnect = BtoAConnect;
+    /// Statically dispatched, single threaded
+    graph.Run(10);
+}
 
-    for(int i = 0; i < 10; i ++){
-        container.moduleA->RunOneCycleTop();
-        container.moduleB->RunOneCycleTop();
-        AtoBConnect->RunOneCycle();
-        BtoAConnect->RunOneCycle();
-    }
+void CycleEngineExample(){
+    ExampleGraph graph;
 
+    /// Modules evaluate in parallel, connects commit after all modules are done
+    CycleEngine engine(2);
+    engine.registerGraph(graph);
+    engine.run(10);
 }
 //
 //void parallelRun(){
 //    constexpr int numThreads = 5; // Specify the desired number of threads
 //
 //    Module m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11, m12, m13, m14;
-//    ThreadPoolOp threadPool;
+//    WorkStealingPool threadPool(numThreads);
+//    threadPool.setCostAware(true);
 //    threadPool.registerModule(&m1);
 //    threadPool.registerModule(&m2);
 //    threadPool.registerModule(&m3);
@@ -139,6 +137,7 @@ void CRTPExample(){
 
 int main() {
     //CRTPExample();
+    //CycleEngineExample();
     //compactMemoryAllocation();
     //threaded_log();
 